@@ -0,0 +1,509 @@
+// Standard allocator workloads, built once per allocator (see the Makefile, "make bench_csv" runs them all).
+// BENCH_ALLOCATOR picks the allocator: 0 is glibc, 1 to 4 are malloc_1.cpp to malloc_4.cpp.
+// Every workload runs in two child processes, one for throughput, peak RSS, metadata, split/merge counts and
+// external fragmentation and one with every allocator call timed for the latency percentiles (which include
+// reading the clock), and prints a CSV row. A workload that crashes an allocator gets a row with only its status.
+// usage: alloc_bench_<allocator> [workload or "all"] [scale]
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <malloc.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define SLOTS_NUM (1024)
+#define LARGE_SLOTS_NUM (64)
+#define REALLOC_SLOTS_NUM (256)
+#define REALLOC_MAX_SIZE (64 * 1024)
+#define LARGE_MIN_SIZE (96 * 1024) // the large sizes straddle the 128 KB SBRK_LIMIT
+#define LARGE_MAX_SIZE (160 * 1024)
+#define LARSON_QUEUE_SIZE (4096)
+#define NO_FREE_BUDGET ((size_t)512 * 1024 * 1024) // malloc_1 never frees, its workloads stop after this many bytes
+#define GLIBC_TOP_PAD (16 * 1024 * 1024)
+
+#if BENCH_ALLOCATOR == 0
+#define ALLOCATOR_NAME "glibc"
+#define THREAD_SAFE_ALLOCATOR
+
+static void* _alloc(size_t size)
+{
+    return malloc(size);
+}
+
+static void _free(void* p)
+{
+    free(p);
+}
+
+static void* _realloc(void* p, size_t, size_t size)
+{
+    return realloc(p, size);
+}
+
+// glibc keeps no such counter, the column is left empty
+static long _meta_data_bytes()
+{
+    return -1;
+}
+
+static void _heap_counts(long* splits, long* coalesces, double* fragmentation)
+{
+    *splits = -1;
+    *coalesces = -1;
+    *fragmentation = -1;
+}
+#else
+void* smalloc(size_t size);
+
+#if BENCH_ALLOCATOR == 1
+#define ALLOCATOR_NAME "malloc_1"
+#define CANNOT_FREE
+
+static void _free(void*)
+{
+}
+
+static void* _realloc(void* p, size_t old_size, size_t size)
+{
+    void* newp = smalloc(size);
+    if (newp != nullptr) {
+        memcpy(newp, p, (old_size < size) ? old_size : size);
+    }
+    return newp;
+}
+
+static long _meta_data_bytes()
+{
+    return 0;
+}
+
+static void _heap_counts(long* splits, long* coalesces, double* fragmentation)
+{
+    *splits = 0;
+    *coalesces = 0;
+    *fragmentation = 0;
+}
+#else
+void sfree(void* p);
+void* srealloc(void* oldp, size_t size);
+size_t _num_meta_data_bytes();
+
+#if BENCH_ALLOCATOR == 4
+#include "../malloc_4.h"
+#endif
+
+#if BENCH_ALLOCATOR == 2
+#define ALLOCATOR_NAME "malloc_2"
+#elif BENCH_ALLOCATOR == 3
+#define ALLOCATOR_NAME "malloc_3"
+#elif defined(MALLOC_THREAD_SAFE)
+#define ALLOCATOR_NAME "malloc_4_thread_safe"
+#define THREAD_SAFE_ALLOCATOR
+#elif defined(MALLOC_HARDENED)
+#define ALLOCATOR_NAME "malloc_4_hardened"
+#elif defined(MALLOC_DEFERRED_COALESCING)
+#define ALLOCATOR_NAME "malloc_4_deferred"
+#elif defined(MALLOC_FIT_POLICY)
+#define STRINGIFY(name) #name
+#define FIT_POLICY_NAME(name) STRINGIFY(name)
+#define ALLOCATOR_NAME "malloc_4_" FIT_POLICY_NAME(MALLOC_FIT_POLICY)
+#else
+#define ALLOCATOR_NAME "malloc_4"
+#endif
+
+static void _free(void* p)
+{
+    sfree(p);
+}
+
+static void* _realloc(void* p, size_t, size_t size)
+{
+    return srealloc(p, size);
+}
+
+static long _meta_data_bytes()
+{
+    return _num_meta_data_bytes();
+}
+
+#if BENCH_ALLOCATOR == 4
+static void _heap_counts(long* splits, long* coalesces, double* fragmentation)
+{
+    smalloc_stats_t stats;
+    smalloc_stats(&stats);
+    *splits = stats.splits;
+    *coalesces = stats.coalesces;
+    *fragmentation = stats.external_fragmentation;
+}
+#else
+// malloc_2 and malloc_3 do not count them
+static void _heap_counts(long* splits, long* coalesces, double* fragmentation)
+{
+    *splits = -1;
+    *coalesces = -1;
+    *fragmentation = -1;
+}
+#endif
+#endif
+
+static void* _alloc(size_t size)
+{
+    return smalloc(size);
+}
+#endif
+
+typedef struct {
+    bool timed;
+    size_t ops;
+    uint32_t* latencies; // one entry per timed allocator call
+    size_t latencies_num;
+    size_t latencies_capacity;
+} bench_t;
+
+// filled by a child process, read by the parent after the child exits
+typedef struct {
+    size_t ops;
+    double seconds;
+    long peak_rss_kb;
+    long meta_data_bytes;
+    long splits;
+    long coalesces;
+    double fragmentation; // external fragmentation of the free memory, see smalloc_stats_t
+    uint32_t p50_ns;
+    uint32_t p99_ns;
+    uint32_t p999_ns;
+    bool failed;
+} result_t;
+
+typedef struct {
+    const char* name;
+    void (*run)(bench_t* bench, result_t* result);
+    size_t ops; // at scale 1
+    size_t mean_size; // used to cut the workload down for malloc_1
+} workload_t;
+
+static uint64_t _now_ns()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static uint64_t _random(uint64_t* state)
+{
+    uint64_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return *state = x;
+}
+
+// 8 bytes to max_size, small sizes are more common like in real programs
+static size_t _random_size(uint64_t* state, size_t max_size)
+{
+    size_t bits = 3 + _random(state) % 10;
+    size_t size = 8 + _random(state) % ((size_t)1 << bits);
+    return (size < max_size) ? size : max_size;
+}
+
+// The harness keeps its own memory out of the allocator that is measured
+static void* _bench_mmap(size_t size)
+{
+    void* p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    return (p == MAP_FAILED) ? nullptr : p;
+}
+
+#define TIMED(bench, call)                                                                \
+    do {                                                                                  \
+        if ((bench)->timed) {                                                             \
+            uint64_t start_ns = _now_ns();                                                \
+            call;                                                                         \
+            if ((bench)->latencies_num < (bench)->latencies_capacity) {                   \
+                (bench)->latencies[(bench)->latencies_num++] = (uint32_t)(_now_ns() - start_ns); \
+            }                                                                             \
+        } else {                                                                          \
+            call;                                                                         \
+        }                                                                                 \
+    } while (0)
+
+static size_t _fixed_size(uint64_t*)
+{
+    return 64;
+}
+
+static size_t _small_size(uint64_t* state)
+{
+    return _random_size(state, 4096);
+}
+
+static size_t _large_size(uint64_t* state)
+{
+    return LARGE_MIN_SIZE + _random(state) % (LARGE_MAX_SIZE - LARGE_MIN_SIZE);
+}
+
+// Alloc or free in random slots, every block is written once
+static void _churn(bench_t* bench, result_t* result, size_t slots_num, size_t (*next_size)(uint64_t*))
+{
+    void** slots = (void**)_bench_mmap(slots_num * sizeof(void*));
+    uint64_t state = 88172645463325252ull;
+    for (size_t op = 0; op < bench->ops; op++) {
+        size_t slot = _random(&state) % slots_num;
+        if (slots[slot] != nullptr) {
+            TIMED(bench, _free(slots[slot]));
+            slots[slot] = nullptr;
+            continue;
+        }
+        size_t size = next_size(&state);
+        TIMED(bench, slots[slot] = _alloc(size));
+        if (slots[slot] == nullptr) {
+            result->failed = true;
+            return;
+        }
+        memset(slots[slot], 1, size);
+    }
+    result->meta_data_bytes = _meta_data_bytes();
+    _heap_counts(&result->splits, &result->coalesces, &result->fragmentation);
+    for (size_t slot = 0; slot < slots_num; slot++) {
+        _free(slots[slot]);
+    }
+}
+
+static void _run_fixed(bench_t* bench, result_t* result)
+{
+    _churn(bench, result, SLOTS_NUM, _fixed_size);
+}
+
+static void _run_random(bench_t* bench, result_t* result)
+{
+    _churn(bench, result, SLOTS_NUM, _small_size);
+}
+
+static void _run_large(bench_t* bench, result_t* result)
+{
+    _churn(bench, result, LARGE_SLOTS_NUM, _large_size);
+}
+
+// Buffers that grow by appending until they reach REALLOC_MAX_SIZE and are then dropped
+static void _run_realloc(bench_t* bench, result_t* result)
+{
+    void** slots = (void**)_bench_mmap(REALLOC_SLOTS_NUM * sizeof(void*));
+    size_t* sizes = (size_t*)_bench_mmap(REALLOC_SLOTS_NUM * sizeof(size_t));
+    uint64_t state = 362436069ull;
+    for (size_t op = 0; op < bench->ops; op++) {
+        size_t slot = _random(&state) % REALLOC_SLOTS_NUM;
+        if (sizes[slot] >= REALLOC_MAX_SIZE) {
+            TIMED(bench, _free(slots[slot]));
+            slots[slot] = nullptr;
+            sizes[slot] = 0;
+            continue;
+        }
+        size_t size = sizes[slot] + 64 + _random(&state) % 192;
+        void* p = nullptr;
+        TIMED(bench, p = (slots[slot] == nullptr) ? _alloc(size) : _realloc(slots[slot], sizes[slot], size));
+        if (p == nullptr) {
+            result->failed = true;
+            return;
+        }
+        memset((char*)p + sizes[slot], 1, size - sizes[slot]);
+        slots[slot] = p;
+        sizes[slot] = size;
+    }
+    result->meta_data_bytes = _meta_data_bytes();
+    _heap_counts(&result->splits, &result->coalesces, &result->fragmentation);
+    for (size_t slot = 0; slot < REALLOC_SLOTS_NUM; slot++) {
+        _free(slots[slot]);
+    }
+}
+
+// Larson style: one thread allocates, the other frees what it gets through a queue.
+// Allocators that are not thread safe are called under a lock.
+static std::mutex allocator_lock;
+
+static void* _shared_alloc(size_t size)
+{
+#ifndef THREAD_SAFE_ALLOCATOR
+    std::lock_guard<std::mutex> guard(allocator_lock);
+#endif
+    return _alloc(size);
+}
+
+static void _shared_free(void* p)
+{
+#ifndef THREAD_SAFE_ALLOCATOR
+    std::lock_guard<std::mutex> guard(allocator_lock);
+#endif
+    _free(p);
+}
+
+static void _run_larson(bench_t* bench, result_t* result)
+{
+    void** queue = (void**)_bench_mmap(LARSON_QUEUE_SIZE * sizeof(void*));
+    std::atomic<size_t> head(0);
+    std::atomic<size_t> tail(0);
+    std::atomic<bool> failed(false);
+    // the consumer keeps its latencies in the second half of the buffer
+    bench_t consumer_bench = *bench;
+    consumer_bench.latencies_capacity = bench->latencies_capacity / 2;
+    consumer_bench.latencies = bench->latencies + consumer_bench.latencies_capacity;
+    bench->latencies_capacity /= 2;
+    std::thread consumer([&]() {
+        for (size_t op = 0; op < consumer_bench.ops; op++) {
+            size_t position = tail.load(std::memory_order_relaxed);
+            while (head.load(std::memory_order_acquire) == position) {
+                if (failed.load(std::memory_order_relaxed)) {
+                    return;
+                }
+            }
+            void* p = queue[position % LARSON_QUEUE_SIZE];
+            TIMED(&consumer_bench, _shared_free(p));
+            tail.store(position + 1, std::memory_order_release);
+        }
+    });
+    uint64_t state = 521288629ull;
+    for (size_t op = 0; op < bench->ops; op++) {
+        size_t position = head.load(std::memory_order_relaxed);
+        while (position - tail.load(std::memory_order_acquire) == LARSON_QUEUE_SIZE) {
+        }
+        size_t size = 16 + _random(&state) % 496;
+        void* p = nullptr;
+        TIMED(bench, p = _shared_alloc(size));
+        if (p == nullptr) {
+            failed.store(true);
+            result->failed = true;
+            break;
+        }
+        memset(p, 1, size);
+        queue[position % LARSON_QUEUE_SIZE] = p;
+        head.store(position + 1, std::memory_order_release);
+    }
+    result->meta_data_bytes = _meta_data_bytes();
+    _heap_counts(&result->splits, &result->coalesces, &result->fragmentation);
+    consumer.join();
+    // move the consumer latencies next to the producer ones
+    memmove(bench->latencies + bench->latencies_num, consumer_bench.latencies, consumer_bench.latencies_num * sizeof(uint32_t));
+    bench->latencies_num += consumer_bench.latencies_num;
+}
+
+static const workload_t workloads[] = {
+    { "fixed", _run_fixed, 2000000, 64 },
+    { "random", _run_random, 1000000, 700 },
+    { "larson", _run_larson, 1000000, 264 },
+    { "realloc", _run_realloc, 200000, REALLOC_MAX_SIZE / 2 },
+    { "large", _run_large, 50000, (LARGE_MIN_SIZE + LARGE_MAX_SIZE) / 2 },
+};
+
+static uint32_t _percentile(uint32_t* latencies, size_t latencies_num, double fraction)
+{
+    if (latencies_num == 0) {
+        return 0;
+    }
+    size_t index = (size_t)(fraction * (latencies_num - 1));
+    std::nth_element(latencies, latencies + index, latencies + latencies_num);
+    return latencies[index];
+}
+
+static void _run_child(const workload_t* workload, size_t ops, bool timed, result_t* result)
+{
+    bench_t bench = { timed, ops, nullptr, 0, 0 };
+    if (timed) {
+        bench.latencies_capacity = ops * 2;
+        bench.latencies = (uint32_t*)_bench_mmap(bench.latencies_capacity * sizeof(uint32_t));
+    }
+    uint64_t start_ns = _now_ns();
+    workload->run(&bench, result);
+    result->seconds = (_now_ns() - start_ns) / 1e9;
+    result->ops = ops;
+    if (timed) {
+        result->p50_ns = _percentile(bench.latencies, bench.latencies_num, 0.5);
+        result->p99_ns = _percentile(bench.latencies, bench.latencies_num, 0.99);
+        result->p999_ns = _percentile(bench.latencies, bench.latencies_num, 0.999);
+    } else {
+        struct rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+        result->peak_rss_kb = usage.ru_maxrss;
+    }
+}
+
+// returns nullptr if the child finished the workload, otherwise what went wrong
+static const char* _fork_run(const workload_t* workload, size_t ops, bool timed, result_t* result)
+{
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0) {
+        _run_child(workload, ops, timed, result);
+        _exit(0);
+    }
+    int status;
+    if (pid < 0 || waitpid(pid, &status, 0) != pid) {
+        return "fork failed";
+    }
+    if (WIFSIGNALED(status)) {
+        return strsignal(WTERMSIG(status));
+    }
+    return result->failed ? "allocation failed" : nullptr;
+}
+
+static void _run_workload(const workload_t* workload, double scale)
+{
+    size_t ops = (size_t)(workload->ops * scale);
+#ifdef CANNOT_FREE
+    // roughly half of the churn operations allocate
+    size_t budget_ops = NO_FREE_BUDGET / workload->mean_size * 2;
+    ops = (ops < budget_ops) ? ops : budget_ops;
+#endif
+    result_t* results = (result_t*)_bench_mmap(2 * sizeof(result_t));
+    const char* error = _fork_run(workload, ops, false, &results[0]);
+    if (error == nullptr) {
+        error = _fork_run(workload, ops, true, &results[1]);
+    }
+    // a workload that crashed the allocator keeps its row so the CSV shows it
+    if (error != nullptr) {
+        printf("%s,%s,%zu,,,,,,,,,,%s\n", ALLOCATOR_NAME, workload->name, ops, error);
+    } else {
+        printf("%s,%s,%zu,%.0f,%u,%u,%u,%ld,", ALLOCATOR_NAME, workload->name, ops, ops / results[0].seconds,
+            results[1].p50_ns, results[1].p99_ns, results[1].p999_ns, results[0].peak_rss_kb);
+        if (results[0].meta_data_bytes >= 0) {
+            printf("%ld", results[0].meta_data_bytes);
+        }
+        printf(",");
+        if (results[0].splits >= 0) {
+            printf("%ld,%ld,%.3f", results[0].splits, results[0].coalesces, results[0].fragmentation);
+        } else {
+            printf(",,");
+        }
+        printf(",ok\n");
+    }
+    munmap(results, 2 * sizeof(result_t));
+}
+
+int main(int argc, char* argv[])
+{
+    const char* name = (argc > 1) ? argv[1] : "all";
+    double scale = (argc > 2) ? atof(argv[2]) : 1;
+#if BENCH_ALLOCATOR != 0
+    // malloc_1 to malloc_4 move the program break without telling glibc, so glibc gets a heap
+    // large enough for the harness before any of them starts
+    mallopt(M_TOP_PAD, GLIBC_TOP_PAD);
+    free(malloc(1));
+#endif
+    printf("allocator,workload,ops,ops_per_sec,p50_ns,p99_ns,p999_ns,peak_rss_kb,meta_data_bytes,splits,coalesces,fragmentation,status\n");
+    bool found = false;
+    for (const workload_t& workload : workloads) {
+        if (strcmp(name, "all") == 0 || strcmp(name, workload.name) == 0) {
+            _run_workload(&workload, scale);
+            found = true;
+        }
+    }
+    if (!found) {
+        fprintf(stderr, "unknown workload %s\n", name);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,63 @@
+// Regression checks for the order of the bins: among free blocks that fit equally well,
+// the one at the lowest address is handed out, which the _num_* counters depend on.
+// Built once on the program break and once with MALLOC_MMAP_ARENAS.
+// usage: bins_check
+#include <cstdio>
+#include "../malloc_4.h"
+
+// Two freed blocks of a size class, the later one must not be reused first
+static bool _lowest_address()
+{
+    size_t allocated_blocks = _num_allocated_blocks();
+    size_t free_blocks = _num_free_blocks();
+    void* p[6];
+    for (void*& block : p) {
+        block = smalloc(64);
+    }
+    sfree(p[0]);
+    sfree(p[2]);
+    void* q = smalloc(64);
+    sfree(p[1]);
+    sfree(p[3]);
+    // p[1] to p[3] merge into one free block, p[4] and p[5] keep it off the wilderness
+    return q == p[0] && _num_free_blocks() - free_blocks == 1 && _num_allocated_blocks() - allocated_blocks == 4;
+}
+
+// Blocks freed out of address order come back in address order. Runs first, a free block
+// left by another check could take p[0] with a tail that puts it in a larger bin.
+static bool _free_order()
+{
+    void* p[3];
+    for (void*& block : p) {
+        block = smalloc(400);
+        smalloc(8); // keeps the blocks from merging
+    }
+    sfree(p[1]);
+    sfree(p[0]);
+    sfree(p[2]);
+    void* a = smalloc(400);
+    void* b = smalloc(400);
+    void* c = smalloc(400);
+    return a == p[0] && b == p[1] && c == p[2];
+}
+
+typedef struct {
+    const char* name;
+    bool (*run)();
+} check_t;
+
+static const check_t checks[] = {
+    { "free_order", _free_order },
+    { "lowest_address", _lowest_address },
+};
+
+int main()
+{
+    int failed = 0;
+    for (const check_t& check : checks) {
+        bool ok = check.run();
+        printf("bins %s: %s\n", check.name, ok ? "ok" : "FAILED");
+        failed += ok ? 0 : 1;
+    }
+    return (failed == 0) ? 0 : 1;
+}
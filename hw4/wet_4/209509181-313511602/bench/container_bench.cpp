@@ -0,0 +1,227 @@
+// Standard containers on std::allocator (glibc) against the same containers on SAllocator (malloc_4),
+// and SPool against new and delete for single objects. Every workload runs once per allocator in a child
+// process of its own, so the peak RSS is that of the run. malloc_4 is built with MALLOC_MMAP_ARENAS
+// so it stays off the program break glibc grows, container_bench_slab adds MALLOC_SLAB for the nodes.
+// usage: container_bench [workload or "all"] [scale]
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <list>
+#include <map>
+#include <memory>
+#include <unordered_map>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "../sallocator.h"
+
+#define KEYS_NUM (200000)
+#define ROUNDS_NUM (5)
+#define POOL_SLOTS_NUM (4096)
+#define POOL_OPS_NUM (4000000)
+
+typedef struct {
+    uint64_t value;
+    uint64_t links[3]; // about the size of a tree node
+} object_t;
+
+static volatile uint64_t sink; // keeps the lookups from being optimized out
+
+static uint64_t _random(uint64_t* state)
+{
+    uint64_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return *state = x;
+}
+
+// Every round inserts random keys, looks all of them up, erases every other one and drops the rest
+template <template <typename> class Allocator>
+static size_t _run_map(size_t keys_num, size_t rounds)
+{
+    typedef std::map<uint64_t, uint64_t, std::less<uint64_t>, Allocator<std::pair<const uint64_t, uint64_t>>> map_t;
+    uint64_t state = 88172645463325252ull;
+    size_t ops = 0;
+    uint64_t sum = 0;
+    for (size_t round = 0; round < rounds; round++) {
+        map_t map;
+        uint64_t round_state = state;
+        for (size_t i = 0; i < keys_num; i++) {
+            map[_random(&state)] = i;
+        }
+        for (size_t i = 0; i < keys_num; i++) {
+            sum += map.count(_random(&round_state));
+        }
+        for (auto it = map.begin(); it != map.end();) {
+            it = map.erase(it);
+            if (it != map.end()) {
+                ++it;
+            }
+        }
+        ops += 3 * keys_num;
+    }
+    sink = sum;
+    return ops;
+}
+
+template <template <typename> class Allocator>
+static size_t _run_unordered_map(size_t keys_num, size_t rounds)
+{
+    typedef std::unordered_map<uint64_t, uint64_t, std::hash<uint64_t>, std::equal_to<uint64_t>,
+        Allocator<std::pair<const uint64_t, uint64_t>>>
+        map_t;
+    uint64_t state = 88172645463325252ull;
+    size_t ops = 0;
+    uint64_t sum = 0;
+    for (size_t round = 0; round < rounds; round++) {
+        map_t map;
+        uint64_t round_state = state;
+        for (size_t i = 0; i < keys_num; i++) {
+            map[_random(&state)] = i;
+        }
+        for (size_t i = 0; i < keys_num; i++) {
+            sum += map.count(_random(&round_state));
+        }
+        for (auto it = map.begin(); it != map.end();) {
+            it = map.erase(it);
+            if (it != map.end()) {
+                ++it;
+            }
+        }
+        ops += 3 * keys_num;
+    }
+    sink = sum;
+    return ops;
+}
+
+// Appends, erases every other node, fills the holes from the front and drops the list
+template <template <typename> class Allocator>
+static size_t _run_list(size_t keys_num, size_t rounds)
+{
+    size_t ops = 0;
+    for (size_t round = 0; round < rounds; round++) {
+        std::list<uint64_t, Allocator<uint64_t>> list;
+        for (size_t i = 0; i < keys_num; i++) {
+            list.push_back(i);
+        }
+        for (auto it = list.begin(); it != list.end();) {
+            it = list.erase(it);
+            if (it != list.end()) {
+                ++it;
+            }
+        }
+        for (size_t i = 0; i < keys_num / 2; i++) {
+            list.push_front(i);
+        }
+        ops += 2 * keys_num;
+    }
+    return ops;
+}
+
+// Creates or destroys objects in random slots
+static size_t _run_new_delete(size_t ops)
+{
+    object_t** slots = (object_t**)calloc(POOL_SLOTS_NUM, sizeof(object_t*));
+    uint64_t state = 362436069ull;
+    for (size_t op = 0; op < ops; op++) {
+        size_t slot = _random(&state) % POOL_SLOTS_NUM;
+        if (slots[slot] != nullptr) {
+            delete slots[slot];
+            slots[slot] = nullptr;
+        } else {
+            slots[slot] = new object_t { op, { 0, 0, 0 } };
+        }
+    }
+    for (size_t slot = 0; slot < POOL_SLOTS_NUM; slot++) {
+        delete slots[slot];
+    }
+    free(slots);
+    return ops;
+}
+
+static size_t _run_pool(size_t ops)
+{
+    SPool<object_t> pool;
+    object_t** slots = (object_t**)calloc(POOL_SLOTS_NUM, sizeof(object_t*));
+    uint64_t state = 362436069ull;
+    for (size_t op = 0; op < ops; op++) {
+        size_t slot = _random(&state) % POOL_SLOTS_NUM;
+        if (slots[slot] != nullptr) {
+            pool.destroy(slots[slot]);
+            slots[slot] = nullptr;
+        } else {
+            slots[slot] = pool.create(object_t { op, { 0, 0, 0 } });
+            if (slots[slot] == nullptr) {
+                fprintf(stderr, "SPool::create failed\n");
+                exit(1);
+            }
+        }
+    }
+    free(slots);
+    return ops;
+}
+
+typedef struct {
+    const char* name;
+    const char* allocator;
+    size_t (*run)(double scale);
+} workload_t;
+
+static const workload_t workloads[] = {
+    { "map", "std::allocator", [](double scale) { return _run_map<std::allocator>(KEYS_NUM * scale, ROUNDS_NUM); } },
+    { "map", "SAllocator", [](double scale) { return _run_map<SAllocator>(KEYS_NUM * scale, ROUNDS_NUM); } },
+    { "unordered_map", "std::allocator",
+        [](double scale) { return _run_unordered_map<std::allocator>(KEYS_NUM * scale, ROUNDS_NUM); } },
+    { "unordered_map", "SAllocator",
+        [](double scale) { return _run_unordered_map<SAllocator>(KEYS_NUM * scale, ROUNDS_NUM); } },
+    { "list", "std::allocator", [](double scale) { return _run_list<std::allocator>(KEYS_NUM * scale, ROUNDS_NUM); } },
+    { "list", "SAllocator", [](double scale) { return _run_list<SAllocator>(KEYS_NUM * scale, ROUNDS_NUM); } },
+    { "pool", "new/delete", [](double scale) { return _run_new_delete(POOL_OPS_NUM * scale); } },
+    { "pool", "SPool", [](double scale) { return _run_pool(POOL_OPS_NUM * scale); } },
+};
+
+static void _run_child(const workload_t* workload, double scale)
+{
+    auto start = std::chrono::steady_clock::now();
+    size_t ops = workload->run(scale);
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    printf("%s,%s,%zu,%.1f,%.0f,%ld\n", workload->name, workload->allocator, ops, elapsed.count() * 1000,
+        ops / elapsed.count(), usage.ru_maxrss);
+    fflush(stdout);
+}
+
+int main(int argc, char* argv[])
+{
+    const char* name = (argc > 1) ? argv[1] : "all";
+    double scale = (argc > 2) ? atof(argv[2]) : 1;
+    printf("workload,allocator,ops,ms,ops_per_sec,peak_rss_kb\n");
+    bool found = false;
+    for (const workload_t& workload : workloads) {
+        if (strcmp(name, "all") != 0 && strcmp(name, workload.name) != 0) {
+            continue;
+        }
+        found = true;
+        fflush(stdout);
+        pid_t pid = fork();
+        if (pid == 0) {
+            _run_child(&workload, scale);
+            _exit(0);
+        }
+        int status;
+        if (pid < 0 || waitpid(pid, &status, 0) != pid || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            printf("%s,%s,,,,\n", workload.name, workload.allocator);
+        }
+    }
+    if (!found) {
+        fprintf(stderr, "unknown workload %s\n", name);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,72 @@
+// Repeated growth of one mmap backed buffer, the way a growing vector or string uses srealloc.
+// "copy" is the old srealloc path (allocate, copy the payload, free the old block),
+// "srealloc" is the current one that lets mremap move the pages.
+// usage: realloc_bench [max size in MB] [rounds]
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include "../malloc_4.h"
+
+#define START_SIZE (256 * 1024)
+#define GROWTH_STEP (256 * 1024)
+#define PAGE_SIZE (4096)
+
+static void* _copy_realloc(void* oldp, size_t old_size, size_t size)
+{
+    void* newp = smalloc(size);
+    if (newp == nullptr) {
+        return nullptr;
+    }
+    memmove(newp, oldp, (old_size < size) ? old_size : size);
+    sfree(oldp);
+    return newp;
+}
+
+// returns the time in seconds, or a negative value if an allocation failed
+static double _grow(bool use_srealloc, size_t max_size, int rounds)
+{
+    auto start = std::chrono::steady_clock::now();
+    for (int round = 0; round < rounds; round++) {
+        size_t size = START_SIZE;
+        char* buffer = (char*)smalloc(size);
+        if (buffer == nullptr) {
+            return -1;
+        }
+        memset(buffer, 1, size);
+        while (size + GROWTH_STEP <= max_size) {
+            size_t new_size = size + GROWTH_STEP;
+            char* new_buffer = (char*)(use_srealloc ? srealloc(buffer, new_size) : _copy_realloc(buffer, size, new_size));
+            if (new_buffer == nullptr) {
+                sfree(buffer);
+                return -1;
+            }
+            buffer = new_buffer;
+            // touch the new part like an appending writer would
+            for (size_t i = size; i < new_size; i += PAGE_SIZE) {
+                buffer[i] = 1;
+            }
+            size = new_size;
+        }
+        sfree(buffer);
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    return elapsed.count();
+}
+
+int main(int argc, char* argv[])
+{
+    size_t max_size = ((argc > 1) ? strtoul(argv[1], nullptr, 10) : 64) * 1024 * 1024;
+    int rounds = (argc > 2) ? atoi(argv[2]) : 5;
+    printf("growing %d buffers from %d KB to %zu MB in %d KB steps\n", rounds, START_SIZE / 1024, max_size / (1024 * 1024), GROWTH_STEP / 1024);
+    const char* names[] = { "copy", "srealloc" };
+    for (int mode = 0; mode < 2; mode++) {
+        double seconds = _grow(mode == 1, max_size, rounds);
+        if (seconds < 0) {
+            printf("%-10s allocation failed\n", names[mode]);
+            return 1;
+        }
+        printf("%-10s %10.3f ms\n", names[mode], seconds * 1000);
+    }
+    return 0;
+}
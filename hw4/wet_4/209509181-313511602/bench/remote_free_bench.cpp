@@ -0,0 +1,102 @@
+// Producer/consumer pairs over the thread-safe malloc_4: every producer allocates buffers too large
+// for the thread caches and hands them to its consumer, which frees them into the producer's arena.
+// remote_free_bench pushes those frees on the arena's lock-free remote free stack,
+// remote_free_bench_locked is built with MALLOC_NO_REMOTE_FREE and takes the arena lock for each of them.
+// usage: remote_free_bench [pairs] [buffers per producer]
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
+#include <vector>
+#include "../malloc_4.h"
+
+#define QUEUE_SIZE (1024)
+#define MIN_BUFFER_SIZE (2 * 1024) // above the thread cache limit
+#define MAX_BUFFER_SIZE (32 * 1024)
+
+#ifdef MALLOC_NO_REMOTE_FREE
+#define FREE_MODE "locked"
+#else
+#define FREE_MODE "remote"
+#endif
+
+// single producer, single consumer ring, head and tail are kept on cache lines of their own
+typedef struct {
+    void* buffers[QUEUE_SIZE];
+    std::atomic<size_t> head;
+    char head_pad[64 - sizeof(std::atomic<size_t>)];
+    std::atomic<size_t> tail;
+    char tail_pad[64 - sizeof(std::atomic<size_t>)];
+} queue_t;
+
+static void _produce(queue_t* queue, size_t buffers_num, unsigned seed, std::vector<uint32_t>* latencies)
+{
+    for (size_t i = 0; i < buffers_num; i++) {
+        seed = seed * 1103515245 + 12345;
+        size_t size = MIN_BUFFER_SIZE + (seed >> 8) % (MAX_BUFFER_SIZE - MIN_BUFFER_SIZE);
+        auto start = std::chrono::steady_clock::now();
+        void* p = smalloc(size);
+        latencies->push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count());
+        if (p == nullptr) {
+            fprintf(stderr, "smalloc(%zu) failed\n", size);
+            exit(1);
+        }
+        memset(p, 1, 64);
+        size_t head = queue->head.load(std::memory_order_relaxed);
+        while (head - queue->tail.load(std::memory_order_acquire) == QUEUE_SIZE) {
+            std::this_thread::yield();
+        }
+        queue->buffers[head % QUEUE_SIZE] = p;
+        queue->head.store(head + 1, std::memory_order_release);
+    }
+}
+
+static void _consume(queue_t* queue, size_t buffers_num)
+{
+    for (size_t i = 0; i < buffers_num; i++) {
+        size_t tail = queue->tail.load(std::memory_order_relaxed);
+        while (queue->head.load(std::memory_order_acquire) == tail) {
+            std::this_thread::yield();
+        }
+        sfree(queue->buffers[tail % QUEUE_SIZE]);
+        queue->tail.store(tail + 1, std::memory_order_release);
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    size_t pairs = (argc > 1) ? strtoul(argv[1], nullptr, 10) : 4;
+    size_t buffers_num = (argc > 2) ? strtoul(argv[2], nullptr, 10) : 500000;
+    std::vector<queue_t> queues(pairs);
+    std::vector<std::vector<uint32_t>> latencies(pairs);
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < pairs; i++) {
+        queues[i].head = 0;
+        queues[i].tail = 0;
+        latencies[i].reserve(buffers_num);
+    }
+    auto start = std::chrono::steady_clock::now();
+    // producers first, so each of them gets an arena of its own
+    for (size_t i = 0; i < pairs; i++) {
+        threads.emplace_back(_produce, &queues[i], buffers_num, (unsigned)i + 1, &latencies[i]);
+    }
+    for (size_t i = 0; i < pairs; i++) {
+        threads.emplace_back(_consume, &queues[i], buffers_num);
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    std::vector<uint32_t> all;
+    for (auto& pair_latencies : latencies) {
+        all.insert(all.end(), pair_latencies.begin(), pair_latencies.end());
+    }
+    std::sort(all.begin(), all.end());
+    printf("%s frees: %zu pairs, %zu buffers, %.0f ms, %.0f buffers/s, smalloc p50 %u ns p99 %u ns\n", FREE_MODE, pairs,
+        pairs * buffers_num, elapsed.count() * 1000, pairs * buffers_num / elapsed.count(), all[all.size() / 2],
+        all[all.size() * 99 / 100]);
+    return 0;
+}
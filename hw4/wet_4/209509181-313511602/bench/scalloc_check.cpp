@@ -0,0 +1,65 @@
+// Regression checks for scalloc, which clears only the memory that was handed out before.
+// Every case reuses the heap in a way that once left non-zero bytes in a scalloc block,
+// built once on the program break and once with MALLOC_MMAP_ARENAS.
+// usage: scalloc_check
+#include <cstdio>
+#include <cstring>
+#include "../malloc_4.h"
+
+// returns the offset of the first non-zero byte, size if there is none
+static size_t _first_non_zero(const void* p, size_t size)
+{
+    const unsigned char* bytes = (const unsigned char*)p;
+    for (size_t i = 0; i < size; i++) {
+        if (bytes[i] != 0) {
+            return i;
+        }
+    }
+    return size;
+}
+
+// A free wilderness grown for a block used to go back into a large bin first,
+// and the tree links it got there landed in the memory just taken from the kernel
+static bool _grown_wilderness()
+{
+    void* large = smalloc(1400);
+    smalloc(8); // keeps the large block from merging into the wilderness
+    void* wilderness = smalloc(8);
+    sfree(large);
+    sfree(wilderness);
+    size_t size = 1504;
+    void* p = scalloc(1, size);
+    return p != nullptr && _first_non_zero(p, size) == size;
+}
+
+static bool _reused_block()
+{
+    size_t size = 4000;
+    void* old = smalloc(size);
+    smalloc(8);
+    memset(old, 0xab, size);
+    sfree(old);
+    void* p = scalloc(size / 8, 8);
+    return p != nullptr && _first_non_zero(p, size) == size;
+}
+
+typedef struct {
+    const char* name;
+    bool (*run)();
+} check_t;
+
+static const check_t checks[] = {
+    { "grown_wilderness", _grown_wilderness },
+    { "reused_block", _reused_block },
+};
+
+int main()
+{
+    int failed = 0;
+    for (const check_t& check : checks) {
+        bool ok = check.run();
+        printf("scalloc %s: %s\n", check.name, ok ? "ok" : "FAILED");
+        failed += ok ? 0 : 1;
+    }
+    return (failed == 0) ? 0 : 1;
+}
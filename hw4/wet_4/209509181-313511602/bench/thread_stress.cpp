@@ -0,0 +1,197 @@
+// Correctness stress for the thread-safe malloc_4. Threads share one table of slots: a thread that finds
+// a slot empty puts a new block there, a thread that finds it taken checks the block and frees it,
+// so most blocks are freed by another thread than the one that allocated them, into an arena of
+// another thread. Every block carries its size and a fill derived from its address, a block that was
+// handed out twice or written by the allocator fails the check.
+// thread_stress frees through the remote free stacks, thread_stress_locked is built with MALLOC_NO_REMOTE_FREE
+// and thread_stress_tsan runs under ThreadSanitizer.
+// usage: thread_stress [threads] [operations per thread]
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
+#include <vector>
+#include "../malloc_4.h"
+
+#define SLOTS_NUM (4096)
+#define THREADS_NUM (8)
+#define OPS_NUM (50000)
+#define HEADER_SIZE (sizeof(size_t)) // the size of the block, in front of its fill
+
+static std::atomic<void*> slots[SLOTS_NUM];
+static std::atomic<size_t> failures(0);
+
+static uint64_t _random(uint64_t* state)
+{
+    uint64_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return *state = x;
+}
+
+// mostly thread cache sizes, then blocks for the arena bins and now and then one for mmap
+static size_t _random_size(uint64_t* state)
+{
+    size_t kind = _random(state) % 100;
+    if (kind < 70) {
+        return HEADER_SIZE + _random(state) % 512;
+    }
+    if (kind < 97) {
+        return 1024 + _random(state) % 16384;
+    }
+    return 128 * 1024 + _random(state) % (512 * 1024);
+}
+
+static uint8_t _fill_byte(void* p)
+{
+    return (uint8_t)((uintptr_t)p >> 4);
+}
+
+static void _fail(const char* what, void* p, size_t size)
+{
+    fprintf(stderr, "thread_stress: %s, block %p of %zu bytes\n", what, p, size);
+    failures++;
+}
+
+static void _fill(void* p, size_t size)
+{
+    memcpy(p, &size, HEADER_SIZE);
+    memset((uint8_t*)p + HEADER_SIZE, _fill_byte(p), size - HEADER_SIZE);
+}
+
+// returns the size of a block written by _fill, 0 if the block is broken
+static size_t _check(void* p)
+{
+    size_t size;
+    memcpy(&size, p, HEADER_SIZE);
+    if (size < HEADER_SIZE || smalloc_usable_size(p) < size) {
+        _fail("broken size", p, size);
+        return 0;
+    }
+    const uint8_t* bytes = (const uint8_t*)p;
+    for (size_t i = HEADER_SIZE; i < size; i++) {
+        if (bytes[i] != _fill_byte(p)) {
+            _fail("broken fill", p, size);
+            return 0;
+        }
+    }
+    return size;
+}
+
+static void* _allocate(uint64_t* state, size_t size)
+{
+    void* p;
+    switch (_random(state) % 8) {
+    case 0: {
+        p = scalloc(1, size);
+        for (size_t i = 0; p != nullptr && i < size; i++) {
+            if (((uint8_t*)p)[i] != 0) {
+                _fail("scalloc block not zero", p, size);
+                break;
+            }
+        }
+        break;
+    }
+    case 1: {
+        size_t alignment = (size_t)16 << (_random(state) % 6);
+        p = saligned_alloc(alignment, (size + alignment - 1) / alignment * alignment);
+        if (p != nullptr && (uintptr_t)p % alignment != 0) {
+            _fail("misaligned", p, size);
+        }
+        break;
+    }
+    default:
+        p = smalloc(size);
+        break;
+    }
+    if (p == nullptr) {
+        _fail("allocation failed", nullptr, size);
+        return nullptr;
+    }
+    _fill(p, size);
+    return p;
+}
+
+// frees a block found in a slot, sometimes by growing or shrinking it and freeing the result
+static void _release(uint64_t* state, void* p)
+{
+    size_t size = _check(p);
+    if (size == 0) {
+        return;
+    }
+    switch (_random(state) % 4) {
+    case 0: {
+        size_t new_size = _random_size(state);
+        void* q = srealloc(p, new_size);
+        if (q == nullptr) {
+            _fail("srealloc failed", p, size);
+            return;
+        }
+        size_t kept = (new_size < size) ? new_size : size;
+        for (size_t i = HEADER_SIZE; i < kept; i++) {
+            if (((uint8_t*)q)[i] != _fill_byte(p)) {
+                _fail("srealloc lost the payload", q, new_size);
+                break;
+            }
+        }
+        sfree(q);
+        break;
+    }
+    case 1:
+        sfree_sized(p, size);
+        break;
+    default:
+        sfree(p);
+        break;
+    }
+}
+
+static void _run(unsigned thread, size_t ops_num)
+{
+    uint64_t state = 0x9E3779B97F4A7C15ull * (thread + 1);
+    for (size_t op = 0; op < ops_num; op++) {
+        std::atomic<void*>* slot = &slots[_random(&state) % SLOTS_NUM];
+        void* p = slot->exchange(nullptr);
+        if (p != nullptr) {
+            _release(&state, p);
+            continue;
+        }
+        p = _allocate(&state, _random_size(&state));
+        void* empty = nullptr;
+        if (p != nullptr && !slot->compare_exchange_strong(empty, p)) {
+            _release(&state, p);
+        }
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    unsigned threads_num = (argc > 1) ? strtoul(argv[1], nullptr, 10) : THREADS_NUM;
+    size_t ops_num = (argc > 2) ? strtoul(argv[2], nullptr, 10) : OPS_NUM;
+    std::vector<std::thread> threads;
+    for (unsigned thread = 0; thread < threads_num; thread++) {
+        threads.emplace_back(_run, thread, ops_num);
+    }
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+    uint64_t state = 1;
+    for (size_t i = 0; i < SLOTS_NUM; i++) {
+        void* p = slots[i].exchange(nullptr);
+        if (p != nullptr) {
+            _release(&state, p);
+        }
+    }
+    // every block is free now, the exited threads flushed their caches and strim drains the remote frees
+    strim(0);
+    if (_num_allocated_blocks() != _num_free_blocks() || _num_allocated_bytes() != _num_free_bytes()) {
+        fprintf(stderr, "thread_stress: %zu blocks of %zu bytes allocated, %zu blocks of %zu bytes free\n",
+            _num_allocated_blocks(), _num_allocated_bytes(), _num_free_blocks(), _num_free_bytes());
+        failures++;
+    }
+    printf("thread_stress: %u threads, %zu operations each, %zu failures\n", threads_num, ops_num, failures.load());
+    return (failures == 0) ? 0 : 1;
+}
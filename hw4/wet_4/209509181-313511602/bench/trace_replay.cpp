@@ -0,0 +1,265 @@
+// Replays a trace recorded by libmalloc_trace.so (see trace.h) against one allocator, built once per allocator
+// like alloc_bench: BENCH_ALLOCATOR 0 is glibc, 2 to 4 are malloc_2.cpp to malloc_4.cpp.
+// The trace is memory mapped and the live blocks are kept in mapped arrays indexed by id, so the replay
+// allocates nothing of its own however long the trace is. The events of all threads are replayed on one
+// thread in trace order, every run of a trace makes the same calls.
+// Every block is written once like a program would, only the allocator calls are timed.
+// Prints a CSV row of the heap statistics after every 1/rows of the trace, the totals go to stderr.
+// usage: trace_replay_<allocator> trace [rows]
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <fcntl.h>
+#include <malloc.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "../trace.h"
+
+#define GLIBC_TOP_PAD (16 * 1024 * 1024)
+
+#if BENCH_ALLOCATOR == 0
+#define ALLOCATOR_NAME "glibc"
+
+static void* _alloc(size_t size)
+{
+    return malloc(size);
+}
+
+static void* _calloc(size_t size)
+{
+    return calloc(1, size);
+}
+
+static void* _realloc(void* p, size_t size)
+{
+    return realloc(p, size);
+}
+
+static void* _memalign(size_t alignment, size_t size)
+{
+    return memalign(alignment, size);
+}
+
+static void _free(void* p)
+{
+    free(p);
+}
+
+// glibc keeps no such counters, their columns are left empty
+static bool _heap_counters(size_t*)
+{
+    return false;
+}
+#else
+#if BENCH_ALLOCATOR == 4
+#include "../malloc_4.h"
+#define ALLOCATOR_NAME "malloc_4"
+#else
+void* smalloc(size_t size);
+void* scalloc(size_t num, size_t size);
+void sfree(void* p);
+void* srealloc(void* oldp, size_t size);
+size_t _num_free_blocks();
+size_t _num_free_bytes();
+size_t _num_allocated_blocks();
+size_t _num_allocated_bytes();
+size_t _num_meta_data_bytes();
+#if BENCH_ALLOCATOR == 2
+#define ALLOCATOR_NAME "malloc_2"
+#elif BENCH_ALLOCATOR == 3
+#define ALLOCATOR_NAME "malloc_3"
+#endif
+#endif
+
+static void* _alloc(size_t size)
+{
+    return smalloc(size);
+}
+
+static void* _calloc(size_t size)
+{
+    return scalloc(1, size);
+}
+
+static void* _realloc(void* p, size_t size)
+{
+    return srealloc(p, size);
+}
+
+#if BENCH_ALLOCATOR == 4
+static void* _memalign(size_t alignment, size_t size)
+{
+    return smemalign(alignment, size);
+}
+#else
+// malloc_2 and malloc_3 have no aligned allocation, the block is only as aligned as any other
+static void* _memalign(size_t, size_t size)
+{
+    return smalloc(size);
+}
+#endif
+
+static void _free(void* p)
+{
+    sfree(p);
+}
+
+static bool _heap_counters(size_t* counters)
+{
+    counters[0] = _num_allocated_blocks();
+    counters[1] = _num_allocated_bytes();
+    counters[2] = _num_free_blocks();
+    counters[3] = _num_free_bytes();
+    counters[4] = _num_meta_data_bytes();
+    return true;
+}
+#endif
+
+#define HEAP_COUNTERS_NUM (5)
+
+static uint64_t _now_ns()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+// The harness keeps its own memory out of the allocator that is measured
+static void* _bench_mmap(size_t size)
+{
+    void* p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    return (p == MAP_FAILED) ? nullptr : p;
+}
+
+// the resident set right now, from /proc/self/statm so that nothing is allocated
+static long _rss_kb()
+{
+    char buffer[128];
+    int fd = open("/proc/self/statm", O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+    ssize_t length = read(fd, buffer, sizeof(buffer) - 1);
+    close(fd);
+    if (length <= 0) {
+        return -1;
+    }
+    buffer[length] = '\0';
+    const char* resident = strchr(buffer, ' ');
+    return (resident == nullptr) ? -1 : atol(resident + 1) * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+static void _print_row(const trace_event_t* event, size_t events_num, uint64_t replay_ns)
+{
+    size_t counters[HEAP_COUNTERS_NUM];
+    printf("%s,%zu,%.3f,%.3f,%ld", ALLOCATOR_NAME, events_num, event->time_ns / 1e6, replay_ns / 1e6, _rss_kb());
+    if (_heap_counters(counters)) {
+        for (size_t i = 0; i < HEAP_COUNTERS_NUM; i++) {
+            printf(",%zu", counters[i]);
+        }
+    } else {
+        printf(",,,,,");
+    }
+    printf("\n");
+}
+
+int main(int argc, char* argv[])
+{
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s trace [rows]\n", argv[0]);
+        return 1;
+    }
+    size_t rows = (argc > 2) ? strtoul(argv[2], nullptr, 10) : 20;
+    int fd = open(argv[1], O_RDONLY);
+    struct stat trace_stat;
+    if (fd < 0 || fstat(fd, &trace_stat) < 0 || (size_t)trace_stat.st_size < sizeof(trace_header_t)) {
+        fprintf(stderr, "cannot read %s\n", argv[1]);
+        return 1;
+    }
+    uint8_t* trace = (uint8_t*)mmap(nullptr, trace_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    const trace_header_t* header = (const trace_header_t*)trace;
+    if (trace == MAP_FAILED || memcmp(header->magic, TRACE_MAGIC, sizeof(TRACE_MAGIC)) != 0
+        || header->event_size != sizeof(trace_event_t)) {
+        fprintf(stderr, "%s is not a trace\n", argv[1]);
+        return 1;
+    }
+    madvise(trace, trace_stat.st_size, MADV_SEQUENTIAL);
+    const trace_event_t* events = (const trace_event_t*)(trace + sizeof(trace_header_t));
+    size_t events_num = (trace_stat.st_size - sizeof(trace_header_t)) / sizeof(trace_event_t);
+    uint32_t ids_num = 0;
+    for (size_t i = 0; i < events_num; i++) {
+        ids_num = (events[i].id >= ids_num) ? events[i].id + 1 : ids_num;
+    }
+    void** blocks = (void**)_bench_mmap(((size_t)ids_num + 1) * sizeof(void*));
+    size_t* sizes = (size_t*)_bench_mmap(((size_t)ids_num + 1) * sizeof(size_t));
+    if (blocks == nullptr || sizes == nullptr) {
+        fprintf(stderr, "cannot map %u blocks\n", ids_num);
+        return 1;
+    }
+#if BENCH_ALLOCATOR != 0
+    // malloc_2 to malloc_4 move the program break without telling glibc, so glibc gets a heap
+    // large enough for stdio before any of them starts
+    mallopt(M_TOP_PAD, GLIBC_TOP_PAD);
+    free(malloc(1));
+#endif
+    printf("allocator,events,trace_ms,replay_ms,rss_kb,allocated_blocks,allocated_bytes,free_blocks,free_bytes,meta_data_bytes\n");
+    size_t row_events = (rows == 0 || events_num / rows == 0) ? 1 : events_num / rows;
+    size_t failed = 0;
+    uint64_t replay_ns = 0;
+    for (size_t i = 0; i < events_num; i++) {
+        trace_event_t event;
+        memcpy(&event, &events[i], sizeof(event));
+        if (event.id >= ids_num || (event.op == TRACE_REALLOC && event.arg >= ids_num)) {
+            fprintf(stderr, "event %zu names a block that does not exist\n", i);
+            return 1;
+        }
+        void* p = nullptr;
+        size_t written = 0;
+        uint64_t start_ns = _now_ns();
+        switch (event.op) {
+        case TRACE_MALLOC:
+            p = _alloc(event.size);
+            break;
+        case TRACE_CALLOC:
+            p = _calloc(event.size);
+            break;
+        case TRACE_REALLOC:
+            written = sizes[event.arg];
+            p = _realloc(blocks[event.arg], event.size);
+            break;
+        case TRACE_MEMALIGN:
+            p = _memalign(event.arg, event.size);
+            break;
+        case TRACE_FREE:
+            _free(blocks[event.id]);
+            break;
+        }
+        replay_ns += _now_ns() - start_ns;
+        if (event.op == TRACE_REALLOC) {
+            blocks[event.arg] = nullptr;
+            sizes[event.arg] = 0;
+        }
+        if (event.op != TRACE_FREE && p == nullptr && event.size != 0) {
+            failed++;
+        }
+        blocks[event.id] = p;
+        sizes[event.id] = (p == nullptr) ? 0 : event.size;
+        if (p != nullptr && event.op != TRACE_CALLOC && event.size > written) {
+            memset((uint8_t*)p + written, 1, event.size - written);
+        }
+        if ((i + 1) % row_events == 0 || i + 1 == events_num) {
+            _print_row(&event, i + 1, replay_ns);
+        }
+    }
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    fprintf(stderr, "%s: %zu events, %zu failed, %.3f ms in the allocator, peak rss %ld kb\n", ALLOCATOR_NAME, events_num,
+        failed, replay_ns / 1e6, usage.ru_maxrss);
+    return 0;
+}
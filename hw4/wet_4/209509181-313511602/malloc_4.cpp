@@ -1,51 +1,379 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // mremap
+#endif
+#include <cerrno>
+#include <cstddef>
 #include <cstdint>
+#include <cstdio>
 #include <cstdlib>
 #include <cstring>
 #include <sys/mman.h>
 #include <time.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <functional>
+
+#include "malloc_4.h"
+#ifdef MALLOC_THREAD_SAFE
+#include <atomic>
+#include <pthread.h>
+#endif
+#ifdef MALLOC_PROFILE
+#include <cmath>
+#include <execinfo.h>
+#include <signal.h>
+#endif
+
 #define SIZE_LIMIT (1e8)
 #define SBRK_LIMIT (128 * 1024 + _size_meta_data()) // 128 KB
 #define HUGE_PAGE_LIMIT (4 * 1024 * 1024) // 4MB
 #define SCALLOC_HUGE_PAGE_LIMIT (2 * 1024 * 1024) // 2MB
+#define HUGE_PAGE_SIZE ((size_t)2 * 1024 * 1024) // hugetlb mappings are sized in whole huge pages
+#define REGULAR_PAGE_SIZE ((size_t)4096)
+#define MMAP_PREFIX(block) ((mmap_prefix_t*)((uint8_t*)(block) - sizeof(mmap_prefix_t)))
+#define MMAP_LENGTH(block) (MMAP_PREFIX(block)->length)
+#define PAGE_TYPE(block) (MMAP_PREFIX(block)->page_type)
+#define MMAP_START(block) ((uint8_t*)MMAP_PREFIX(block) - MMAP_PREFIX(block)->offset)
+#define IS_HUGE_PAGE_TYPE(page_type) ((page_type) != REGULAR_PAGE)
 #define REDUNDANT_SIZE (128 + _size_meta_data())
 #define IS_REDUNDANT(block, block_size) ((block)->size - (block_size) >= REDUNDANT_SIZE)
-#define TAIL_METADATA(block) ((tail_metadata_t*)((uint8_t*)(block) + ((block)->size - sizeof(tail_metadata_t))))
-#define IS_SBRK_ALLOC(block) ((block)->size < SBRK_LIMIT)
+// Only the header stays in an allocated block, the links and the footer of a free block live in its payload
+#ifndef MALLOC_ALIGNMENT
+#define MALLOC_ALIGNMENT (8) // alignment of every payload, the preload library uses 16 like glibc
+#endif
+#define HEAD_SIZE (offsetof(head_metadata_t, next))
+#define MIN_BLOCK_SIZE ((sizeof(head_metadata_t) + sizeof(size_t) + MALLOC_ALIGNMENT - 1) & ~((size_t)MALLOC_ALIGNMENT - 1))
+#define BLOCK_PAYLOAD(block) ((void*)((uint8_t*)(block) + HEAD_SIZE))
+#define PAYLOAD_BLOCK(p) ((head_metadata_t*)((uint8_t*)(p) - HEAD_SIZE))
+#define ALLOC_BLOCK_SIZE(size) (((size) + HEAD_SIZE < MIN_BLOCK_SIZE) ? MIN_BLOCK_SIZE : (size) + HEAD_SIZE)
+#define FOOTER(block) ((size_t*)((uint8_t*)(block) + (block)->size - sizeof(size_t)))
+#define IS_SBRK_ALLOC(block) (BLOCK_STATE(block) != BLOCK_MMAPPED)
 #define ALLOC_SBRK(block_size) ((block_size) < SBRK_LIMIT)
+// The flags of a block hold its state and PREV_FREE, set while the block before it is free and has a footer.
+// Another thread may set PREV_FREE while the owner of a cached block changes its state, so both are atomic.
+#define STATE_MASK ((size_t)0x7)
+#define PREV_FREE ((size_t)0x8)
+#define BLOCK_FLAGS(block) __atomic_load_n(&(block)->flags, __ATOMIC_RELAXED)
+#define BLOCK_STATE(block) (BLOCK_FLAGS(block) & STATE_MASK)
+#define SET_BLOCK_STATE(block, value) _set_block_flags(block, STATE_MASK, (size_t)(value))
+#define SET_PREV_FREE(block, prev_free) _set_block_flags(block, PREV_FREE, (prev_free) ? PREV_FREE : 0)
+// Free sbrk blocks are kept in segregated bins, exact 8 byte classes below SMALL_BIN_LIMIT
+// and LARGE_BINS_PER_POWER log-spaced classes for every power of two above it.
+// A small bin is a treap sorted by address, a large bin is a red-black tree sorted by size and address.
+#define SMALL_BIN_LIMIT (1024)
+#define SMALL_BIN_POWER (10) // log2(SMALL_BIN_LIMIT)
+#define SMALL_BINS_NUM (SMALL_BIN_LIMIT / 8)
+#define LARGE_BIN_SHIFT (2)
+#define LARGE_BINS_PER_POWER (1 << LARGE_BIN_SHIFT)
+#define LARGE_BINS_NUM (LARGE_BINS_PER_POWER * 22) // up to 4GB, the last bin takes everything above
+#define BINS_NUM (SMALL_BINS_NUM + LARGE_BINS_NUM)
+#define BINMAP_WORDS ((BINS_NUM + 63) / 64)
+#define TREE_NODE(block) ((tree_node_t*)((uint8_t*)(block) + sizeof(head_metadata_t)))
+#define TREE_IS_RED(block) ((block) != nullptr && TREE_NODE(block)->red)
+#define TREE_LESS(a, b) ((a)->size < (b)->size || ((a)->size == (b)->size && (a) < (b)))
+// Thread caches hold freed blocks of the exact bin sizes
+#define TCACHE_LIMIT (SMALL_BIN_LIMIT)
+#define TCACHE_BINS_NUM (TCACHE_LIMIT / 8)
+#define TCACHE_COUNT (16) // blocks per bin before half of the bin is flushed
+#define TCACHE_REFILL (TCACHE_COUNT / 2) // blocks taken from the heap bins on a miss
+#define QUICK_LIMIT (SMALL_BIN_LIMIT)
+#define QUICK_BINS_NUM (QUICK_LIMIT / 8)
+#ifndef MALLOC_FIT_POLICY
+#define MALLOC_FIT_POLICY best_fit // first_fit, next_fit, best_fit or good_fit, see fit_policy
+#endif
+#ifndef MALLOC_GOOD_FIT_CANDIDATES
+#define MALLOC_GOOD_FIT_CANDIDATES (8)
+#endif
+#define FIT_POLICY_TYPE_OF(name) name##_policy_t
+#define FIT_POLICY_TYPE(name) FIT_POLICY_TYPE_OF(name)
+#define QUICK_CONSOLIDATE_BYTES ((size_t)256 * 1024) // parked bytes after which sfree merges every quick list
+#define ARENA_RESERVE_SIZE ((size_t)1 << 30) // address space reserved by every mmap arena
+#define ARENA_COMMIT_SIZE (1024 * 1024) // mmap arenas become read/write in 1MB steps
+#ifdef MALLOC_THREAD_SAFE
+#define ARENAS_NUM (8)
+#else
+#define ARENAS_NUM (1)
+#endif
+#ifndef TRIM_THRESHOLD
+#define TRIM_THRESHOLD ((size_t)128 * 1024) // sfree cuts back a free wilderness this large, like M_TRIM_THRESHOLD
+#endif
+#define TRIM_PAD ((size_t)128 * 1024) // free wilderness left after an automatic trim, like M_TOP_PAD
+#ifndef RELEASE_THRESHOLD
+#define RELEASE_THRESHOLD ((size_t)1024 * 1024) // sfree drops the pages it frees into a free block this large inside the heap
+#endif
+#define PAGE_ALIGN_UP(p) (((uintptr_t)(p) + REGULAR_PAGE_SIZE - 1) & ~(REGULAR_PAGE_SIZE - 1))
+#define PAGE_ALIGN_DOWN(p) ((uintptr_t)(p) & ~(REGULAR_PAGE_SIZE - 1))
+
+#ifndef MMAP_CACHE_SIZE
+#define MMAP_CACHE_SIZE ((size_t)64 * 1024 * 1024) // bytes of freed mappings kept for reuse, 0 disables the cache
+#endif
+#define MMAP_CACHE_ENTRIES (32)
+#define SARENA_CHUNK_SIZE ((size_t)64 * 1024) // regions bump allocate from chunks this large, below SBRK_LIMIT
+#define MMAP_CACHE_DECAY_NS ((uint64_t)1000000000) // a mapping idle in the cache for 1s is unmapped
+#define MMAP_CACHE_NODE(block) ((mmap_cache_node_t*)((uint8_t*)(block) + sizeof(head_metadata_t)))
+
+// With MALLOC_SLAB objects up to SLAB_LIMIT bytes live in page sized slabs without a header
+#if defined(MALLOC_SLAB) && MALLOC_ALIGNMENT != 8
+#error "slab objects are only 8 byte aligned"
+#endif
+#define SLAB_SIZE (4096)
+#define SLAB_LIMIT (128)
+#define SLAB_CLASSES_NUM (SLAB_LIMIT / 8)
+#define SLAB_REGION_SIZE ((size_t)1 << 30) // address space reserved for slabs
+#define SLAB_BITMAP_WORDS (SLAB_SIZE / 8 / 64)
+#define SLAB_OBJECTS(slab) ((uint8_t*)(slab) + sizeof(slab_t))
+#define SLAB_CAPACITY(object_size) ((SLAB_SIZE - sizeof(slab_t)) / (object_size))
+#define SLAB_OF(p) ((slab_t*)((uintptr_t)(p) & ~((uintptr_t)SLAB_SIZE - 1)))
 
-// We use the next field in head_metadata as a flag to check if the block is inside huge page
+// With MALLOC_PROFILE about one allocation in every sample interval bytes records its backtrace
+#define PROFILE_DEPTH (32)
+#define PROFILE_SKIP (1) // the frame of _profile_sample
+#define PROFILE_STACKS_NUM (4096) // distinct backtraces
+#define PROFILE_LIVE_BITS (16)
+#define PROFILE_LIVE_NUM ((size_t)1 << PROFILE_LIVE_BITS) // live sampled allocations
+#define PROFILE_MAX_PROBE (64) // a sample that finds no slot this close to its hash is dropped
+#define PROFILE_RECHECK_BYTES ((ssize_t)1024 * 1024) // bytes a thread allocates before it looks again while sampling is off
+#define PROFILE_TOMBSTONE ((void*)1)
+
+// Which of the huge page tiers an mmap block got, REGULAR_PAGE if none
 typedef enum {
     REGULAR_PAGE,
-    HUGE_PAGE
+    HUGE_PAGE, // MAP_HUGETLB
+    TRANSPARENT_HUGE_PAGE, // 2MB aligned mapping with MADV_HUGEPAGE
+    PAGE_TYPES_NUM
 } mmap_page_type_e;
 
+typedef enum {
+    BLOCK_ALLOCATED,
+    BLOCK_FREE,
+    BLOCK_CACHED, // freed into a thread cache or a quick list, counted as free but never merged
+    BLOCK_MMAPPED,
+    BLOCK_UNMAPPED // freed into the mmap cache, counted as neither allocated nor free
+} block_state_e;
+
+// Blocks are found by their boundary tags, the footer of a free block repeats its size in its last word.
+// next and prev are bin links that exist only while the block is free, the payload of an allocated block starts there.
 typedef struct head_metadata {
+#ifdef MALLOC_HARDENED
+    size_t cookie; // checked before the header is trusted, an overflow of the block before hits it first
+#endif
     size_t size;
-    size_t is_free;
+    size_t flags;
     struct head_metadata* next;
     struct head_metadata* prev;
 } head_metadata_t;
+static_assert(HEAD_SIZE % MALLOC_ALIGNMENT == 0, "the payload has to stay aligned after the header");
 
+// Put in front of the header of an mmap block, at the start of its mapping unless the block was aligned
 typedef struct {
-    uint32_t cookie;
-    size_t size;
-} tail_metadata_t;
+    size_t length;
+    mmap_page_type_e page_type;
+    uint32_t offset; // bytes between the start of the mapping and the prefix
+} mmap_prefix_t;
+
+// Tree links of a free block in a large bin, kept in the unused payload of the block
+typedef struct {
+    struct head_metadata* left;
+    struct head_metadata* right;
+    struct head_metadata* parent;
+    size_t red;
+} tree_node_t;
+
+// Links of a mapping in the mmap cache, kept in its payload
+typedef struct {
+    struct head_metadata* next;
+    struct head_metadata* prev;
+    uint64_t freed_at;
+} mmap_cache_node_t;
+
+// A heap of sbrk blocks with its own program break. The first arena moves the real program
+// break through _sbrk unless MALLOC_MMAP_ARENAS is defined, any other arena emulates a break
+// inside an mmap reserved region that is made read/write on demand.
+typedef struct {
+    head_metadata_t* head;
+    head_metadata_t* last; // the wilderness block, it has no footer while allocated
+    head_metadata_t* bins[BINS_NUM];
+    uint64_t binmap[BINMAP_WORDS];
+    uint8_t* base;
+    uint8_t* top;
+    uint8_t* committed;
+    uint8_t* clean; // the highest break so far, the memory above it was never handed out and is still zero
+    head_metadata_t* rover; // the block the last next fit search took
+#ifdef MALLOC_DEFERRED_COALESCING
+    head_metadata_t* quick[QUICK_BINS_NUM]; // freed blocks parked by their exact size, see _quick_push
+    size_t quick_bytes;
+#endif
+#ifdef MALLOC_THREAD_SAFE
+    pthread_mutex_t lock;
+    head_metadata_t* remote_frees; // blocks freed by threads of other arenas, pushed without the lock
+#endif
+} arena_t;
 
+// Header at the start of every slab page, found from an object by masking its address
+typedef struct slab {
+    struct slab* next;
+    struct slab* prev;
+    uint32_t object_size;
+    uint32_t free_objects;
+    uint64_t free_map[SLAB_BITMAP_WORDS]; // a set bit marks a free object
+} slab_t;
+
+typedef struct {
+    slab_t* partial; // slabs with at least one free object
+#ifdef MALLOC_THREAD_SAFE
+    pthread_mutex_t lock;
+#endif
+} slab_class_t;
+
+#ifdef MALLOC_HARDENED
 uint32_t global_rand_cookie = 0;
-head_metadata_t* sbrk_head = nullptr;
-head_metadata_t* sbrk_free_head = nullptr;
+#endif
+arena_t arenas[ARENAS_NUM];
+
+#ifdef MALLOC_THREAD_SAFE
+typedef std::atomic<size_t> counter_t;
+#else
+typedef size_t counter_t;
+#endif
+
+counter_t free_blocks_num(0);
+counter_t free_bytes_num(0);
+counter_t allocated_blocks_num(0);
+counter_t allocated_bytes_num(0);
+counter_t slab_objects_num(0);
+counter_t slab_meta_data_bytes(0);
+counter_t splits_num(0);
+counter_t coalesces_num(0);
+counter_t quick_blocks_num(0);
+counter_t consolidations_num(0);
+counter_t free_histogram[SMALLOC_STATS_BUCKETS]; // free blocks in the bins by their size
+counter_t mmap_blocks_num[PAGE_TYPES_NUM]; // allocated mmap blocks by page type
+counter_t region_bytes_num(0); // payload of the chunks held by regions, counted as allocated too
+counter_t region_used_bytes_num(0);
+
+// Freed mappings bucketed like the large bins by their length, newest first
+head_metadata_t* mmap_cache[BINS_NUM];
+size_t mmap_cache_bytes = 0;
+// _mmap_cache_tick reads these two without the lock, they are stored atomically
+size_t mmap_cache_entries = 0;
+uint64_t mmap_cache_decayed_at = 0;
+#ifdef MALLOC_THREAD_SAFE
+pthread_mutex_t mmap_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+// A region chunk, the objects of the region follow the header
+typedef struct sarena_chunk {
+    struct sarena_chunk* next;
+    size_t size; // bytes after the header
+} sarena_chunk_t;
+
+// Regions are not thread safe, every request is expected to have its own
+struct sarena {
+    sarena_chunk_t* chunks; // reused in this order after a reset
+    sarena_chunk_t* current;
+    sarena_chunk_t* large; // chunks of a single object larger than chunk_size, freed by a reset
+    uint8_t* next; // the bump pointer inside current
+    uint8_t* end;
+    size_t chunk_size;
+    size_t used_bytes;
+};
+
+#ifdef MALLOC_PROFILE
+// A distinct backtrace and the sampled allocations made from it. Slots are never freed,
+// the dump reads them without a lock once depth is set.
+typedef struct {
+    uint64_t hash;
+    size_t depth; // 0 while the slot is empty
+    void* frames[PROFILE_DEPTH];
+    size_t live_samples;
+    size_t live_bytes;
+    size_t total_samples;
+    size_t total_bytes;
+} profile_stack_t;
+
+// A live sampled allocation, its weight is the bytes it stands for with the allocations that were not sampled
+typedef struct {
+    void* p; // nullptr for an empty slot, PROFILE_TOMBSTONE for a removed one
+    size_t weight;
+    uint32_t stack;
+} profile_sample_t;
+
+profile_stack_t profile_stacks[PROFILE_STACKS_NUM];
+profile_sample_t profile_samples[PROFILE_LIVE_NUM];
+size_t profile_interval = 0; // mean bytes between samples, 0 while sampling is off
+counter_t profile_live_samples(0);
+int profile_signal_fd = STDERR_FILENO;
+#ifdef MALLOC_THREAD_SAFE
+#define PROFILE_THREAD_LOCAL thread_local
+pthread_mutex_t profile_lock = PTHREAD_MUTEX_INITIALIZER;
+#define PROFILE_LOCK() pthread_mutex_lock(&profile_lock)
+#define PROFILE_UNLOCK() pthread_mutex_unlock(&profile_lock)
+#else
+#define PROFILE_THREAD_LOCAL
+#define PROFILE_LOCK()
+#define PROFILE_UNLOCK()
+#endif
+PROFILE_THREAD_LOCAL ssize_t profile_countdown = 0; // bytes left before the next sample
+PROFILE_THREAD_LOCAL bool profile_armed = false; // the countdown was drawn while sampling was on
+PROFILE_THREAD_LOCAL bool profile_busy = false; // backtrace allocates the first time it runs
+PROFILE_THREAD_LOCAL uint64_t profile_random = 0;
+
+// The public entry points count the bytes they hand out and free calls look for a sample only while there is one,
+// so sampling costs a subtraction per allocation and a load per free while it is off
+#define PROFILE_MALLOC(p, size) if ((p) != nullptr && (profile_countdown -= (ssize_t)(size)) < 0) _profile_sample(p, size)
+#define PROFILE_FREE(p) if (profile_live_samples != 0 && (p) != nullptr) _profile_free(p)
+#else
+#define PROFILE_MALLOC(p, size)
+#define PROFILE_FREE(p)
+#endif
+
+#ifdef MALLOC_SLAB
+slab_class_t slab_classes[SLAB_CLASSES_NUM];
+uint8_t* slab_base = nullptr;
+uint8_t* slab_top = nullptr;
+slab_t* empty_slabs = nullptr;
+#ifdef MALLOC_THREAD_SAFE
+pthread_mutex_t slab_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+#endif
+
+#ifdef MALLOC_THREAD_SAFE
+typedef struct {
+    head_metadata_t* head;
+    size_t count;
+} tcache_bin_t;
+
+typedef struct {
+    tcache_bin_t bins[TCACHE_BINS_NUM];
+    bool registered;
+} tcache_t;
+
+pthread_once_t thread_safe_once = PTHREAD_ONCE_INIT;
+pthread_key_t tcache_key;
+std::atomic<size_t> next_arena(0);
+thread_local tcache_t tcache;
+thread_local arena_t* thread_arena = nullptr;
 
-size_t free_blocks_num = 0;
-size_t free_bytes_num = 0;
-size_t allocated_blocks_num = 0;
-size_t allocated_bytes_num = 0;
+// The arena lock guards its bins, its head and its program break
+#define ARENA_LOCK(arena) pthread_mutex_lock(&(arena)->lock)
+#define ARENA_UNLOCK(arena) pthread_mutex_unlock(&(arena)->lock)
+#define MMAP_CACHE_LOCK() pthread_mutex_lock(&mmap_cache_lock)
+#define MMAP_CACHE_UNLOCK() pthread_mutex_unlock(&mmap_cache_lock)
+#else
+bool arenas_initialized = false;
+
+#define ARENA_LOCK(arena)
+#define ARENA_UNLOCK(arena)
+#define MMAP_CACHE_LOCK()
+#define MMAP_CACHE_UNLOCK()
+#endif
 
 // Challenge 7
 size_t _8_bit_align(size_t size)
 {
-    return (size % 8 != 0) ? (size & (-8)) + 8 : size; // used to align the blocks
+    // used to align the blocks, to MALLOC_ALIGNMENT bytes when that is more than 8
+    return (size % MALLOC_ALIGNMENT != 0) ? (size & -(size_t)MALLOC_ALIGNMENT) + MALLOC_ALIGNMENT : size;
 }
 
 size_t _num_free_blocks()
@@ -66,19 +394,32 @@ size_t _num_allocated_bytes()
 }
 size_t _size_meta_data()
 {
-    // 48 bytes
-    return sizeof(head_metadata_t) + sizeof(tail_metadata_t);
+    // 16 bytes, 24 with MALLOC_HARDENED
+    return HEAD_SIZE;
+}
+size_t _num_hugetlb_blocks()
+{
+    return mmap_blocks_num[HUGE_PAGE];
+}
+size_t _num_transparent_huge_page_blocks()
+{
+    return mmap_blocks_num[TRANSPARENT_HUGE_PAGE];
+}
+size_t _num_regular_page_blocks()
+{
+    return mmap_blocks_num[REGULAR_PAGE];
 }
 size_t _num_meta_data_bytes()
 {
-    return _size_meta_data() * allocated_blocks_num;
+    // slab objects have no header, their slabs carry one per page
+    return _size_meta_data() * (allocated_blocks_num - slab_objects_num) + slab_meta_data_bytes;
 }
 
 void* _sbrk(intptr_t delta)
 {
     static void* program_break = sbrk(0);
-    if ((size_t)program_break % 8 != 0) {
-        sbrk(8 - (size_t)program_break % 8);
+    if ((size_t)program_break % MALLOC_ALIGNMENT != 0) {
+        sbrk(MALLOC_ALIGNMENT - (size_t)program_break % MALLOC_ALIGNMENT);
         program_break = sbrk(0);
     }
     if (delta == 0) {
@@ -88,6 +429,16 @@ void* _sbrk(intptr_t delta)
     if (sbrk_break == (void*)(-1)) {
         return sbrk_break;
     }
+    if (delta < 0) {
+        // The real break is only moved back if nobody else moved it past ours,
+        // otherwise the memory stays mapped and is reused when the heap grows again
+        if (sbrk_break == program_break) {
+            sbrk(delta);
+        }
+        void* prev_break = program_break;
+        program_break = (void*)((intptr_t)program_break + delta);
+        return prev_break;
+    }
     if ((intptr_t)program_break + delta > (intptr_t)sbrk_break) {
         sbrk_break = sbrk((intptr_t)program_break + delta - (intptr_t)sbrk_break);
         if (sbrk_break == (void*)(-1)) {
@@ -99,403 +450,2639 @@ void* _sbrk(intptr_t delta)
     return prev_break;
 }
 
-// has to be set after setting block head metadata
-static void _set_tail(head_metadata_t* block)
+static bool _arena_uses_sbrk(arena_t* arena)
 {
-    if (global_rand_cookie == 0) {
-        srand(time(nullptr));
+#ifdef MALLOC_MMAP_ARENAS
+    (void)arena;
+    return false;
+#else
+    return arena == &arenas[0];
+#endif
+}
+
+// moves the program break of the arena, same as _sbrk does for the real one
+static void* _arena_sbrk_move(arena_t* arena, intptr_t delta)
+{
+    if (_arena_uses_sbrk(arena)) {
+        return _sbrk(delta);
+    }
+    if (arena->base == nullptr) {
+        return (void*)(-1);
+    }
+    if (delta == 0) {
+        return arena->top;
+    }
+    if (delta < 0) {
+        // the pages stay read/write but are no longer backed by memory
+        uint8_t* new_top = arena->top + delta;
+        uint8_t* release_start = (uint8_t*)PAGE_ALIGN_UP(new_top);
+        if (release_start < arena->committed) {
+            madvise(release_start, arena->committed - release_start, MADV_DONTNEED);
+        }
+        void* prev_top = arena->top;
+        arena->top = new_top;
+        return prev_top;
+    }
+    if (delta > arena->base + ARENA_RESERVE_SIZE - arena->top) {
+        return (void*)(-1);
+    }
+    uint8_t* new_top = arena->top + delta;
+    if (new_top > arena->committed) {
+        size_t commit_size = (new_top - arena->committed + ARENA_COMMIT_SIZE - 1) / ARENA_COMMIT_SIZE * ARENA_COMMIT_SIZE;
+        if (mprotect(arena->committed, commit_size, PROT_READ | PROT_WRITE) != 0) {
+            return (void*)(-1);
+        }
+        arena->committed += commit_size;
+    }
+    void* prev_top = arena->top;
+    arena->top = new_top;
+    return prev_top;
+}
+
+// Memory given back and taken again is counted as used, even where the kernel has zeroed it
+static void* _arena_sbrk(arena_t* arena, intptr_t delta)
+{
+    void* prev_top = _arena_sbrk_move(arena, delta);
+    if (delta > 0 && prev_top != (void*)(-1) && (uint8_t*)prev_top + delta > arena->clean) {
+        arena->clean = (uint8_t*)prev_top + delta;
+    }
+    return prev_top;
+}
+
+static void _init_arenas()
+{
+    for (size_t i = 0; i < ARENAS_NUM; i++) {
+#ifdef MALLOC_THREAD_SAFE
+        pthread_mutex_init(&arenas[i].lock, nullptr);
+#endif
+        if (_arena_uses_sbrk(&arenas[i])) {
+            continue;
+        }
+        void* base = mmap(nullptr, ARENA_RESERVE_SIZE, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (base == (void*)(-1)) {
+            continue;
+        }
+        arenas[i].base = (uint8_t*)base;
+        arenas[i].top = (uint8_t*)base;
+        arenas[i].committed = (uint8_t*)base;
+    }
+}
+
+// returns the arena an sbrk block belongs to
+static arena_t* _block_arena(head_metadata_t* block)
+{
+    for (size_t i = 0; i < ARENAS_NUM; i++) {
+        uint8_t* base = arenas[i].base;
+        if (base != nullptr && (uint8_t*)block >= base && (uint8_t*)block < base + ARENA_RESERVE_SIZE) {
+            return &arenas[i];
+        }
     }
+    return &arenas[0];
+}
+
+static void _init_slabs()
+{
+#ifdef MALLOC_SLAB
+#ifdef MALLOC_THREAD_SAFE
+    for (size_t i = 0; i < SLAB_CLASSES_NUM; i++) {
+        pthread_mutex_init(&slab_classes[i].lock, nullptr);
+    }
+#endif
+    void* base = mmap(nullptr, SLAB_REGION_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (base != (void*)(-1)) {
+        slab_base = (uint8_t*)base;
+        slab_top = (uint8_t*)base;
+    }
+#endif
+}
+
+#ifdef MALLOC_HARDENED
+static void _init_cookie()
+{
+    srand(time(nullptr));
     while (global_rand_cookie == 0) {
         global_rand_cookie = rand();
     }
-    tail_metadata_t* tail = TAIL_METADATA(block);
-    tail->cookie = global_rand_cookie;
-    tail->size = block->size;
+}
+#endif
+
+#ifdef MALLOC_THREAD_SAFE
+static void _tcache_destroy(void* cache);
+
+static void _lock_all()
+{
+    for (size_t i = 0; i < ARENAS_NUM; i++) {
+        ARENA_LOCK(&arenas[i]);
+    }
+#ifdef MALLOC_SLAB
+    for (size_t i = 0; i < SLAB_CLASSES_NUM; i++) {
+        pthread_mutex_lock(&slab_classes[i].lock);
+    }
+    pthread_mutex_lock(&slab_pool_lock);
+#endif
+    pthread_mutex_lock(&mmap_cache_lock);
+#ifdef MALLOC_PROFILE
+    PROFILE_LOCK();
+#endif
+}
+
+static void _unlock_all()
+{
+#ifdef MALLOC_PROFILE
+    PROFILE_UNLOCK();
+#endif
+    pthread_mutex_unlock(&mmap_cache_lock);
+#ifdef MALLOC_SLAB
+    pthread_mutex_unlock(&slab_pool_lock);
+    for (size_t i = 0; i < SLAB_CLASSES_NUM; i++) {
+        pthread_mutex_unlock(&slab_classes[i].lock);
+    }
+#endif
+    for (size_t i = 0; i < ARENAS_NUM; i++) {
+        ARENA_UNLOCK(&arenas[i]);
+    }
+}
+
+static void _reset_locks()
+{
+    for (size_t i = 0; i < ARENAS_NUM; i++) {
+        pthread_mutex_init(&arenas[i].lock, nullptr);
+    }
+#ifdef MALLOC_SLAB
+    for (size_t i = 0; i < SLAB_CLASSES_NUM; i++) {
+        pthread_mutex_init(&slab_classes[i].lock, nullptr);
+    }
+    pthread_mutex_init(&slab_pool_lock, nullptr);
+#endif
+    pthread_mutex_init(&mmap_cache_lock, nullptr);
+#ifdef MALLOC_PROFILE
+    pthread_mutex_init(&profile_lock, nullptr);
+#endif
+}
+
+static void _thread_safe_init()
+{
+#ifdef MALLOC_HARDENED
+    _init_cookie();
+#endif
+    _init_arenas();
+    _init_slabs();
+    pthread_key_create(&tcache_key, _tcache_destroy);
+    // a forked child must not inherit a lock held by another thread of its parent
+    pthread_atfork(_lock_all, _unlock_all, _reset_locks);
+}
+#endif
+
+static arena_t* _thread_arena()
+{
+#ifdef MALLOC_THREAD_SAFE
+    if (thread_arena == nullptr) {
+        pthread_once(&thread_safe_once, _thread_safe_init);
+        // Threads are spread over the arenas round-robin
+        thread_arena = &arenas[next_arena++ % ARENAS_NUM];
+        if (!_arena_uses_sbrk(thread_arena) && thread_arena->base == nullptr) {
+            thread_arena = &arenas[0];
+        }
+    }
+    return thread_arena;
+#else
+    if (!arenas_initialized) {
+        _init_arenas();
+        _init_slabs();
+        arenas_initialized = true;
+    }
+    return &arenas[0];
+#endif
 }
 
 // Challenge 5
+// The cookie is only kept with MALLOC_HARDENED, it has to be set after the rest of the header
+static void _set_cookie(head_metadata_t* block)
+{
+#ifdef MALLOC_HARDENED
+#ifdef MALLOC_THREAD_SAFE
+    pthread_once(&thread_safe_once, _thread_safe_init);
+#else
+    if (global_rand_cookie == 0) {
+        _init_cookie();
+    }
+#endif
+    block->cookie = global_rand_cookie;
+#else
+    (void)block;
+#endif
+}
+
 static void _check_cookie(head_metadata_t* block)
 {
-    tail_metadata_t* tail = TAIL_METADATA(block);
-    if (global_rand_cookie != 0 && global_rand_cookie != tail->cookie) {
+#ifdef MALLOC_HARDENED
+    if (global_rand_cookie != 0 && global_rand_cookie != block->cookie) {
         exit(0xdeadbeef);
     }
+#else
+    (void)block;
+#endif
 }
 
-static head_metadata_t* _init_sbrk_alloc_block(head_metadata_t* block, size_t block_size, bool alloc)
+static void _set_block_flags(head_metadata_t* block, size_t mask, size_t value)
 {
-    if (alloc) {
-        if (_sbrk(block_size) == (void*)(-1)) {
-            return nullptr;
-        }
+#ifdef MALLOC_THREAD_SAFE
+    size_t flags = BLOCK_FLAGS(block);
+    while (!__atomic_compare_exchange_n(&block->flags, &flags, (flags & ~mask) | value, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
     }
+#else
+    block->flags = (block->flags & ~mask) | value;
+#endif
+}
+
+// The payload of the block is left as is and so is PREV_FREE,
+// a block made of fresh memory has to clear its flags first
+static head_metadata_t* _init_sbrk_alloc_block(head_metadata_t* block, size_t block_size)
+{
     block->size = block_size;
-    block->is_free = false;
-    block->next = nullptr;
-    block->prev = nullptr;
-    _set_tail(block);
+    SET_BLOCK_STATE(block, BLOCK_ALLOCATED);
+    _set_cookie(block);
     return block;
 }
 
-static head_metadata_t* _wilderness_sbrk_block_increase(head_metadata_t* wilderness, size_t block_size)
+static head_metadata_t* _wilderness_sbrk_block_increase(arena_t* arena, head_metadata_t* wilderness, size_t block_size)
 {
     size_t delta = block_size - wilderness->size;
-    if (_sbrk(delta) == (void*)(-1)) {
+    if (_arena_sbrk(arena, delta) == (void*)(-1)) {
         return nullptr;
     }
     wilderness->size = block_size;
-    _set_tail(wilderness);
     return wilderness;
 }
 
-// returns the best fit free block if not found returns nullptr
-static head_metadata_t* _find_sbrk_free_block(size_t block_size)
+static size_t _bin_index(size_t block_size)
 {
-    head_metadata_t* min = nullptr;
-    head_metadata_t* wilderness = nullptr;
-    if (sbrk_free_head == nullptr) {
-        return nullptr;
-    }
-    void* program_break = _sbrk(0);
-    for (head_metadata_t* current = sbrk_free_head; current != nullptr; current = current->next) {
-        _check_cookie(current);
-        // Challenge 0
-        if (current->size >= block_size && (min == nullptr || min->size > current->size)) {
-            min = current;
-        }
-        // Challenge 3
-        if ((void*)((uint8_t*)current + current->size) == program_break) {
-            wilderness = current;
-        }
-    }
-    if (min != nullptr) {
-        return min;
+    if (block_size < SMALL_BIN_LIMIT) {
+        return block_size / 8;
     }
-    if (wilderness != nullptr) {
-        free_bytes_num += block_size - wilderness->size;
-        allocated_bytes_num += block_size - wilderness->size;
-        return _wilderness_sbrk_block_increase(wilderness, block_size);
-    }
-    return nullptr;
+    size_t power = 63 - __builtin_clzll(block_size);
+    size_t index = SMALL_BINS_NUM + (power - SMALL_BIN_POWER) * LARGE_BINS_PER_POWER;
+    index += (block_size >> (power - LARGE_BIN_SHIFT)) & (LARGE_BINS_PER_POWER - 1);
+    return (index < BINS_NUM) ? index : BINS_NUM - 1;
 }
 
-static void _add_sbrk_free_block(head_metadata_t* block)
+// free blocks by the power of two below their size, starting at 32 bytes
+static size_t _histogram_bucket(size_t block_size)
 {
-    block->is_free = true;
-    block->prev = nullptr;
-    if (sbrk_free_head == nullptr || block->size < sbrk_free_head->size || (block->size == sbrk_free_head->size && block < sbrk_free_head)) {
-        head_metadata_t* temp = sbrk_free_head;
-        sbrk_free_head = block;
-        block->next = temp;
-        if (temp) {
-            temp->prev = block;
-        }
-        return;
+    size_t power = 63 - __builtin_clzll(block_size);
+    size_t bucket = (power < 5) ? 0 : power - 5;
+    return (bucket < SMALLOC_STATS_BUCKETS) ? bucket : SMALLOC_STATS_BUCKETS - 1;
+}
+
+// returns the first non empty bin starting from index, BINS_NUM if there is none
+static size_t _next_non_empty_bin(arena_t* arena, size_t index)
+{
+    size_t word = index / 64;
+    if (word >= BINMAP_WORDS) {
+        return BINS_NUM;
     }
-    head_metadata_t* current;
-    _check_cookie(sbrk_free_head);
-    for (current = sbrk_free_head; current->next != nullptr; current = current->next) {
-        head_metadata_t* next = current->next;
-        _check_cookie(next);
-        if (block->size < next->size || (block->size == next->size && block < next)) {
-            block->prev = current;
-            block->next = next;
-            next->prev = block;
-            current->next = block;
-            return;
+    uint64_t bits = arena->binmap[word] & (~(uint64_t)0 << (index % 64));
+    while (bits == 0) {
+        if (++word == BINMAP_WORDS) {
+            return BINS_NUM;
         }
+        bits = arena->binmap[word];
     }
-    block->prev = current;
-    block->next = nullptr;
-    current->next = block;
+    return word * 64 + __builtin_ctzll(bits);
 }
 
-static void _remove_sbrk_free_block(head_metadata_t* block)
+// Challenge 3
+// returns the block that ends at the program break, nullptr if the heap is empty
+static head_metadata_t* _sbrk_wilderness_block(arena_t* arena)
 {
-    block->is_free = false;
-    if (sbrk_free_head == block) {
-        sbrk_free_head = block->next;
-        block->next = nullptr;
-        block->prev = nullptr;
-        return;
+    if (arena->last != nullptr) {
+        _check_cookie(arena->last);
     }
-    head_metadata_t* prev = block->prev;
-    head_metadata_t* next = block->next;
-    if (prev) {
-        _check_cookie(prev);
-        prev->next = next;
+    return arena->last;
+}
+
+// returns the block after block, nullptr for the wilderness
+static head_metadata_t* _next_sbrk_block(arena_t* arena, head_metadata_t* block)
+{
+    return (block == arena->last) ? nullptr : (head_metadata_t*)((uint8_t*)block + block->size);
+}
+
+static void _tree_replace_child(head_metadata_t** root, head_metadata_t* parent, head_metadata_t* old_child, head_metadata_t* new_child)
+{
+    if (parent == nullptr) {
+        *root = new_child;
+    } else if (TREE_NODE(parent)->left == old_child) {
+        TREE_NODE(parent)->left = new_child;
+    } else {
+        TREE_NODE(parent)->right = new_child;
     }
-    if (next) {
-        _check_cookie(next);
-        next->prev = prev;
+}
+
+static void _tree_rotate_left(head_metadata_t** root, head_metadata_t* block)
+{
+    head_metadata_t* right = TREE_NODE(block)->right;
+    TREE_NODE(block)->right = TREE_NODE(right)->left;
+    if (TREE_NODE(right)->left) {
+        TREE_NODE(TREE_NODE(right)->left)->parent = block;
     }
-    block->next = nullptr;
-    block->prev = nullptr;
+    TREE_NODE(right)->parent = TREE_NODE(block)->parent;
+    _tree_replace_child(root, TREE_NODE(block)->parent, block, right);
+    TREE_NODE(right)->left = block;
+    TREE_NODE(block)->parent = right;
 }
 
-static void _init_sbrk_free_block(head_metadata_t* block, size_t block_size)
+static void _tree_rotate_right(head_metadata_t** root, head_metadata_t* block)
 {
-    block->size = block_size;
-    block->next = nullptr;
-    block->prev = nullptr;
-    _set_tail(block);
-    _add_sbrk_free_block(block);
+    head_metadata_t* left = TREE_NODE(block)->left;
+    TREE_NODE(block)->left = TREE_NODE(left)->right;
+    if (TREE_NODE(left)->right) {
+        TREE_NODE(TREE_NODE(left)->right)->parent = block;
+    }
+    TREE_NODE(left)->parent = TREE_NODE(block)->parent;
+    _tree_replace_child(root, TREE_NODE(block)->parent, block, left);
+    TREE_NODE(left)->right = block;
+    TREE_NODE(block)->parent = left;
 }
 
-// Challenge 2
-static head_metadata_t* _merge_sbrk_blocks(head_metadata_t* block, bool merge_left = true, bool merge_right = true, bool copy_data = false)
+static void _tree_insert(head_metadata_t** root, head_metadata_t* block)
 {
-    size_t block_size_sum = block->size;
-    head_metadata_t* returned_block = block;
-    head_metadata_t* left_block = nullptr;
-    head_metadata_t* right_block = nullptr;
-    if (merge_left && sbrk_head != block) {
-        size_t prev_block_size = ((tail_metadata_t*)((uint8_t*)block - sizeof(tail_metadata_t)))->size;
-        left_block = (head_metadata_t*)((uint8_t*)block - prev_block_size);
-        _check_cookie(left_block);
+    head_metadata_t* parent = nullptr;
+    head_metadata_t** link = root;
+    while (*link != nullptr) {
+        parent = *link;
+        _check_cookie(parent);
+        link = TREE_LESS(block, parent) ? &TREE_NODE(parent)->left : &TREE_NODE(parent)->right;
     }
-    if (merge_right && (void*)((uint8_t*)block + block->size) != _sbrk(0)) {
-        right_block = (head_metadata_t*)((uint8_t*)block + block->size);
-        _check_cookie(right_block);
+    TREE_NODE(block)->left = nullptr;
+    TREE_NODE(block)->right = nullptr;
+    TREE_NODE(block)->parent = parent;
+    TREE_NODE(block)->red = true;
+    *link = block;
+    while (block != *root && TREE_NODE(parent = TREE_NODE(block)->parent)->red) {
+        head_metadata_t* grandparent = TREE_NODE(parent)->parent;
+        bool parent_is_left = (parent == TREE_NODE(grandparent)->left);
+        head_metadata_t* uncle = parent_is_left ? TREE_NODE(grandparent)->right : TREE_NODE(grandparent)->left;
+        if (uncle && TREE_NODE(uncle)->red) {
+            TREE_NODE(parent)->red = false;
+            TREE_NODE(uncle)->red = false;
+            TREE_NODE(grandparent)->red = true;
+            block = grandparent;
+            continue;
+        }
+        if (parent_is_left) {
+            if (block == TREE_NODE(parent)->right) {
+                _tree_rotate_left(root, parent);
+                parent = block;
+            }
+            _tree_rotate_right(root, grandparent);
+        } else {
+            if (block == TREE_NODE(parent)->left) {
+                _tree_rotate_right(root, parent);
+                parent = block;
+            }
+            _tree_rotate_left(root, grandparent);
+        }
+        TREE_NODE(parent)->red = false;
+        TREE_NODE(grandparent)->red = true;
+        break;
     }
-    if (left_block && left_block->is_free) {
-        returned_block = left_block;
-        block_size_sum += left_block->size;
-        free_blocks_num--;
-        allocated_blocks_num--;
-        free_bytes_num -= left_block->size - _size_meta_data();
-        allocated_bytes_num += _size_meta_data();
-        _remove_sbrk_free_block(left_block);
-        if (copy_data) {
-            memmove((void*)((uint8_t*)left_block + sizeof(head_metadata_t)), (void*)((uint8_t*)block + sizeof(head_metadata_t)), block->size - _size_meta_data());
+    TREE_NODE(*root)->red = false;
+}
+
+// restores the red-black properties after a black node was removed above child
+static void _tree_remove_fixup(head_metadata_t** root, head_metadata_t* child, head_metadata_t* parent)
+{
+    while (child != *root && (child == nullptr || !TREE_NODE(child)->red)) {
+        if (child == TREE_NODE(parent)->left) {
+            head_metadata_t* sibling = TREE_NODE(parent)->right;
+            if (TREE_NODE(sibling)->red) {
+                TREE_NODE(sibling)->red = false;
+                TREE_NODE(parent)->red = true;
+                _tree_rotate_left(root, parent);
+                sibling = TREE_NODE(parent)->right;
+            }
+            if (!TREE_IS_RED(TREE_NODE(sibling)->left) && !TREE_IS_RED(TREE_NODE(sibling)->right)) {
+                TREE_NODE(sibling)->red = true;
+                child = parent;
+                parent = TREE_NODE(child)->parent;
+                continue;
+            }
+            if (!TREE_IS_RED(TREE_NODE(sibling)->right)) {
+                TREE_NODE(TREE_NODE(sibling)->left)->red = false;
+                TREE_NODE(sibling)->red = true;
+                _tree_rotate_right(root, sibling);
+                sibling = TREE_NODE(parent)->right;
+            }
+            TREE_NODE(sibling)->red = TREE_NODE(parent)->red;
+            TREE_NODE(parent)->red = false;
+            TREE_NODE(TREE_NODE(sibling)->right)->red = false;
+            _tree_rotate_left(root, parent);
+        } else {
+            head_metadata_t* sibling = TREE_NODE(parent)->left;
+            if (TREE_NODE(sibling)->red) {
+                TREE_NODE(sibling)->red = false;
+                TREE_NODE(parent)->red = true;
+                _tree_rotate_right(root, parent);
+                sibling = TREE_NODE(parent)->left;
+            }
+            if (!TREE_IS_RED(TREE_NODE(sibling)->left) && !TREE_IS_RED(TREE_NODE(sibling)->right)) {
+                TREE_NODE(sibling)->red = true;
+                child = parent;
+                parent = TREE_NODE(child)->parent;
+                continue;
+            }
+            if (!TREE_IS_RED(TREE_NODE(sibling)->left)) {
+                TREE_NODE(TREE_NODE(sibling)->right)->red = false;
+                TREE_NODE(sibling)->red = true;
+                _tree_rotate_left(root, sibling);
+                sibling = TREE_NODE(parent)->left;
+            }
+            TREE_NODE(sibling)->red = TREE_NODE(parent)->red;
+            TREE_NODE(parent)->red = false;
+            TREE_NODE(TREE_NODE(sibling)->left)->red = false;
+            _tree_rotate_right(root, parent);
         }
+        child = *root;
     }
-    if (right_block && right_block->is_free) {
-        block_size_sum += right_block->size;
-        free_blocks_num--;
-        allocated_blocks_num--;
-        free_bytes_num -= right_block->size - _size_meta_data();
-        allocated_bytes_num += _size_meta_data();
-        _remove_sbrk_free_block(right_block);
+    if (child) {
+        TREE_NODE(child)->red = false;
     }
-    return _init_sbrk_alloc_block(returned_block, block_size_sum, false);
 }
 
-static head_metadata_t* _sbrk_malloc(size_t block_size)
+static void _tree_remove(head_metadata_t** root, head_metadata_t* block)
 {
-    head_metadata_t* last_block;
-    if (sbrk_head) {
-        head_metadata_t* last_searched = _find_sbrk_free_block(block_size);
-        if (last_searched) {
-            free_blocks_num--;
-            free_bytes_num -= last_searched->size - _size_meta_data();
-            _remove_sbrk_free_block(last_searched);
-            // Challenge 1
-            if (IS_REDUNDANT(last_searched, block_size)) {
-                free_blocks_num++;
-                free_bytes_num += last_searched->size - _size_meta_data() - block_size;
-                allocated_blocks_num++;
-                allocated_bytes_num -= _size_meta_data();
-                size_t prev_size = last_searched->size;
-                _init_sbrk_alloc_block(last_searched, block_size, false);
-                _init_sbrk_free_block((head_metadata_t*)((uint8_t*)last_searched + block_size), prev_size - block_size);
-            }
-            return last_searched;
+    tree_node_t* node = TREE_NODE(block);
+    head_metadata_t* child;
+    head_metadata_t* parent;
+    bool removed_red = node->red;
+    if (node->left == nullptr || node->right == nullptr) {
+        child = (node->left) ? node->left : node->right;
+        parent = node->parent;
+        _tree_replace_child(root, parent, block, child);
+        if (child) {
+            TREE_NODE(child)->parent = parent;
         }
     } else {
-        sbrk_head = (head_metadata_t*)_sbrk(0);
-        if (sbrk_head == (head_metadata_t*)(-1)) {
-            sbrk_head = nullptr;
-            return nullptr;
+        // the successor takes the place of the removed block
+        head_metadata_t* successor = node->right;
+        while (TREE_NODE(successor)->left) {
+            successor = TREE_NODE(successor)->left;
+        }
+        tree_node_t* successor_node = TREE_NODE(successor);
+        removed_red = successor_node->red;
+        child = successor_node->right;
+        if (successor_node->parent == block) {
+            parent = successor;
+        } else {
+            parent = successor_node->parent;
+            TREE_NODE(parent)->left = child;
+            if (child) {
+                TREE_NODE(child)->parent = parent;
+            }
+            successor_node->right = node->right;
+            TREE_NODE(node->right)->parent = successor;
         }
+        _tree_replace_child(root, node->parent, block, successor);
+        successor_node->parent = node->parent;
+        successor_node->left = node->left;
+        TREE_NODE(node->left)->parent = successor;
+        successor_node->red = node->red;
+    }
+    if (!removed_red) {
+        _tree_remove_fixup(root, child, parent);
     }
-    last_block = (head_metadata_t*)_sbrk(0);
-    last_block = _init_sbrk_alloc_block(last_block, block_size, true);
-    allocated_blocks_num++;
-    allocated_bytes_num += block_size - _size_meta_data();
-    return last_block;
 }
 
-// Challenge 4
-static head_metadata_t* _mmap_malloc(size_t block_size, bool force_hugepage = false)
+// returns the smallest block that is at least size bytes, the lowest address among equal sizes
+static head_metadata_t* _tree_lower_bound(head_metadata_t* root, size_t size)
 {
-    // Challenge 6
-    int flags = MAP_PRIVATE | MAP_ANONYMOUS;
-    flags |= (force_hugepage || block_size >= HUGE_PAGE_LIMIT) ? MAP_HUGETLB : 0;
-    void* mmap_addr = mmap(nullptr, block_size, PROT_READ | PROT_WRITE, flags, -1, 0);
-    if (mmap_addr == (void*)(-1)) {
-        return nullptr;
-    }
-    head_metadata_t* block = (head_metadata_t*)mmap_addr;
-    // We use the sbrk function because it fits our needs (we don't call sbrk of course)
-    _init_sbrk_alloc_block(block, block_size, false);
-    if (force_hugepage || block_size >= HUGE_PAGE_LIMIT) {
-        block->next = (head_metadata_t*)HUGE_PAGE;
-    } else {
-        block->next = (head_metadata_t*)REGULAR_PAGE;
+    head_metadata_t* found = nullptr;
+    while (root != nullptr) {
+        _check_cookie(root);
+        if (root->size >= size) {
+            found = root;
+            root = TREE_NODE(root)->left;
+        } else {
+            root = TREE_NODE(root)->right;
+        }
     }
-    allocated_blocks_num++;
-    allocated_bytes_num += block_size - _size_meta_data();
-    return block;
+    return found;
 }
 
-void* smalloc(size_t size)
+// in order successor
+static head_metadata_t* _tree_next(head_metadata_t* block)
 {
-    head_metadata_t* block;
-    size = _8_bit_align(size);
-    if (size == 0 || size > SIZE_LIMIT) {
-        return nullptr;
+    if (TREE_NODE(block)->right != nullptr) {
+        block = TREE_NODE(block)->right;
+        while (TREE_NODE(block)->left != nullptr) {
+            block = TREE_NODE(block)->left;
+        }
+        return block;
     }
-    size_t block_size = size + _size_meta_data();
-    if (ALLOC_SBRK(block_size)) {
-        block = _sbrk_malloc(block_size);
-    } else {
-        block = _mmap_malloc(block_size);
+    head_metadata_t* parent = TREE_NODE(block)->parent;
+    while (parent != nullptr && block == TREE_NODE(parent)->right) {
+        block = parent;
+        parent = TREE_NODE(parent)->parent;
     }
-    return (block) ? (void*)((uint8_t*)block + sizeof(head_metadata_t)) : nullptr;
+    return parent;
 }
 
-void* scalloc(size_t num, size_t size)
+// A small bin has no room for a red-black node in its shortest blocks, so it is a treap on the list links:
+// next is the left child, prev the right one, and a hash of the address is the heap priority.
+// The blocks of a bin all have its size, so the lowest address is the one the bins hand out.
+static uint64_t _small_bin_priority(head_metadata_t* block)
 {
-    void* alloc;
-    size = _8_bit_align(num * size);
-    if (size == 0 || size > SIZE_LIMIT) {
-        return nullptr;
+    uint64_t x = (uintptr_t)block;
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdull;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ull;
+    return x ^ (x >> 33);
+}
+
+static void _small_bin_insert(head_metadata_t** root, head_metadata_t* block)
+{
+    uint64_t priority = _small_bin_priority(block);
+    head_metadata_t** link = root;
+    while (*link != nullptr && _small_bin_priority(*link) > priority) {
+        _check_cookie(*link);
+        link = (block < *link) ? &(*link)->next : &(*link)->prev;
     }
-    size_t block_size = size + _size_meta_data();
-    if (block_size > SCALLOC_HUGE_PAGE_LIMIT + _size_meta_data()) {
-        head_metadata_t* block = _mmap_malloc(block_size, true);
-        if (block == nullptr) {
-            return nullptr;
+    // the subtree block takes the place of is split by address into its two children
+    head_metadata_t* rest = *link;
+    head_metadata_t** left = &block->next;
+    head_metadata_t** right = &block->prev;
+    while (rest != nullptr) {
+        _check_cookie(rest);
+        if (rest < block) {
+            *left = rest;
+            left = &rest->prev;
+            rest = rest->prev;
+        } else {
+            *right = rest;
+            right = &rest->next;
+            rest = rest->next;
         }
-        alloc = (void*)((uint8_t*)block + sizeof(head_metadata_t));
-    } else {
-        alloc = smalloc(size);
-    }
-    if (alloc == nullptr) {
-        return nullptr;
     }
-    memset(alloc, 0, size);
-    return alloc;
+    *left = nullptr;
+    *right = nullptr;
+    *link = block;
 }
 
-void _sbrk_free(head_metadata_t* block)
+static void _small_bin_remove(head_metadata_t** root, head_metadata_t* block)
 {
-    block = _merge_sbrk_blocks(block);
-    free_blocks_num++;
-    free_bytes_num += block->size - _size_meta_data();
-    _add_sbrk_free_block(block);
+    head_metadata_t** link = root;
+    while (*link != block) {
+        _check_cookie(*link);
+        link = (block < *link) ? &(*link)->next : &(*link)->prev;
+    }
+    // every block on the left is below every block on the right, so the children are merged by priority alone
+    head_metadata_t* left = block->next;
+    head_metadata_t* right = block->prev;
+    while (left != nullptr && right != nullptr) {
+        if (_small_bin_priority(left) > _small_bin_priority(right)) {
+            *link = left;
+            link = &left->prev;
+            left = left->prev;
+        } else {
+            *link = right;
+            link = &right->next;
+            right = right->next;
+        }
+    }
+    *link = (left != nullptr) ? left : right;
+    block->next = nullptr;
+    block->prev = nullptr;
 }
 
-void _mmap_free(head_metadata_t* block_to_free)
+// returns the lowest block of a non empty small bin
+static head_metadata_t* _small_bin_first(head_metadata_t* root)
 {
-    allocated_blocks_num--;
-    allocated_bytes_num -= block_to_free->size - _size_meta_data();
-    munmap((void*)block_to_free, block_to_free->size);
+    _check_cookie(root);
+    while (root->next != nullptr) {
+        root = root->next;
+        _check_cookie(root);
+    }
+    return root;
 }
 
-void sfree(void* p)
+static void _add_sbrk_free_block(arena_t* arena, head_metadata_t* block)
 {
-    if (p == nullptr) {
-        return;
+    size_t index = _bin_index(block->size);
+    head_metadata_t* following = _next_sbrk_block(arena, block);
+    SET_BLOCK_STATE(block, BLOCK_FREE);
+    *FOOTER(block) = block->size;
+    free_histogram[_histogram_bucket(block->size)]++;
+    if (following != nullptr) {
+        SET_PREV_FREE(following, true);
     }
-    head_metadata_t* block_to_free = (head_metadata_t*)((uint8_t*)p - sizeof(head_metadata_t));
-    _check_cookie(block_to_free);
-    if (block_to_free->is_free) {
+    arena->binmap[index / 64] |= (uint64_t)1 << (index % 64);
+    if (index >= SMALL_BINS_NUM) {
+        block->next = nullptr;
+        block->prev = nullptr;
+        _tree_insert(&arena->bins[index], block);
         return;
     }
-    if (IS_SBRK_ALLOC(block_to_free)) {
-        _sbrk_free(block_to_free);
+    _small_bin_insert(&arena->bins[index], block);
+}
+
+static void _remove_sbrk_free_block(arena_t* arena, head_metadata_t* block)
+{
+    size_t index = _bin_index(block->size);
+    head_metadata_t* following = _next_sbrk_block(arena, block);
+    SET_BLOCK_STATE(block, BLOCK_ALLOCATED);
+    free_histogram[_histogram_bucket(block->size)]--;
+    if (following != nullptr) {
+        SET_PREV_FREE(following, false);
+    }
+    if (index >= SMALL_BINS_NUM) {
+        _tree_remove(&arena->bins[index], block);
     } else {
-        _mmap_free(block_to_free);
+        _small_bin_remove(&arena->bins[index], block);
+    }
+    if (arena->bins[index] == nullptr) {
+        arena->binmap[index / 64] &= ~((uint64_t)1 << (index % 64));
     }
 }
 
-static void* _sbrk_realloc(head_metadata_t* block, size_t block_size)
+// How _find_sbrk_free_block picks a free block. The bins keep blocks by size, so the first block
+// that fits there is the best fit. Without the bins the heap is walked in address order like malloc_2,
+// from its start or, when roving, from the block the previous search took, and the smallest
+// of the first candidates blocks that fit is taken.
+template <bool bins, bool roving, size_t candidates>
+struct fit_policy {
+    static const bool BINS = bins;
+    static const bool ROVING = roving;
+    static const size_t CANDIDATES = candidates;
+};
+typedef fit_policy<true, false, 1> best_fit_policy_t;
+typedef fit_policy<false, false, 1> first_fit_policy_t;
+typedef fit_policy<false, true, 1> next_fit_policy_t;
+typedef fit_policy<false, false, MALLOC_GOOD_FIT_CANDIDATES> good_fit_policy_t;
+typedef FIT_POLICY_TYPE(MALLOC_FIT_POLICY) fit_policy_t;
+
+// a block merged into another one can no longer be where next fit resumes
+static void _rover_absorbed(arena_t* arena, head_metadata_t* absorbed, head_metadata_t* into)
 {
-    void* program_break = _sbrk(0);
-    // Try to reuse the same block
+    if (arena->rover == absorbed) {
+        arena->rover = into;
+    }
+}
+
+static head_metadata_t* _bins_fit_sbrk_block(arena_t* arena, size_t block_size)
+{
+    size_t index = _bin_index(block_size);
+    // Challenge 0
+    if (index < SMALL_BINS_NUM) {
+        if (arena->bins[index] != nullptr) {
+            return _small_bin_first(arena->bins[index]);
+        }
+    } else {
+        head_metadata_t* found = _tree_lower_bound(arena->bins[index], block_size);
+        if (found != nullptr) {
+            return found;
+        }
+    }
+    index = _next_non_empty_bin(arena, index + 1);
+    if (index != BINS_NUM) {
+        // every block of a later bin fits, the first block of the bin is the best fit
+        if (index >= SMALL_BINS_NUM) {
+            return _tree_lower_bound(arena->bins[index], 0);
+        }
+        return _small_bin_first(arena->bins[index]);
+    }
+    return nullptr;
+}
+
+template <typename policy>
+static head_metadata_t* _walk_fit_sbrk_block(arena_t* arena, size_t block_size)
+{
+    if (arena->last == nullptr) {
+        return nullptr;
+    }
+    head_metadata_t* start = arena->head;
+    if (policy::ROVING && arena->rover != nullptr && arena->rover <= arena->last) {
+        start = arena->rover;
+    }
+    head_metadata_t* found = nullptr;
+    size_t candidates = 0;
+    head_metadata_t* block = start;
+    do {
+        _check_cookie(block);
+        if (BLOCK_STATE(block) == BLOCK_FREE && block->size >= block_size) {
+            if (found == nullptr || block->size < found->size) {
+                found = block;
+            }
+            if (++candidates == policy::CANDIDATES) {
+                break;
+            }
+        }
+        block = _next_sbrk_block(arena, block);
+        if (block == nullptr) {
+            block = arena->head;
+        }
+    } while (block != start);
+    if (policy::ROVING && found != nullptr) {
+        arena->rover = found;
+    }
+    return found;
+}
+
+template <typename policy>
+static head_metadata_t* _fit_sbrk_block(arena_t* arena, size_t block_size)
+{
+    return policy::BINS ? _bins_fit_sbrk_block(arena, block_size) : _walk_fit_sbrk_block<policy>(arena, block_size);
+}
+
+// returns the free block picked by fit_policy_t, if not found returns nullptr
+static head_metadata_t* _find_sbrk_free_block(arena_t* arena, size_t block_size)
+{
+    return _fit_sbrk_block<fit_policy_t>(arena, block_size);
+}
+
+// Challenge 3
+// Hands out the free wilderness grown to block_size, nullptr if it is not free or the break cannot move.
+// The grown block goes straight from its bin to the caller, put back into a bin it would write
+// its links and footer into the memory just taken from the kernel, which scalloc expects to be zero.
+static head_metadata_t* _grow_sbrk_wilderness(arena_t* arena, size_t block_size)
+{
+    head_metadata_t* wilderness = _sbrk_wilderness_block(arena);
+    if (wilderness == nullptr || BLOCK_STATE(wilderness) != BLOCK_FREE) {
+        return nullptr;
+    }
+    size_t prev_size = wilderness->size;
+    _remove_sbrk_free_block(arena, wilderness);
+    if (_wilderness_sbrk_block_increase(arena, wilderness, block_size) == nullptr) {
+        _add_sbrk_free_block(arena, wilderness);
+        return nullptr;
+    }
+    free_blocks_num--;
+    free_bytes_num -= prev_size - _size_meta_data();
+    allocated_bytes_num += block_size - prev_size;
+    return _init_sbrk_alloc_block(wilderness, block_size);
+}
+
+static void _init_sbrk_free_block(arena_t* arena, head_metadata_t* block, size_t block_size)
+{
+    block->size = block_size;
+    _set_cookie(block);
+    _add_sbrk_free_block(arena, block);
+}
+
+// Challenge 1
+// the end of an allocated block becomes a free block if it is big enough
+static void _split_sbrk_block(arena_t* arena, head_metadata_t* block, size_t block_size)
+{
+    if (!IS_REDUNDANT(block, block_size)) {
+        return;
+    }
+    free_blocks_num++;
+    free_bytes_num += block->size - block_size - _size_meta_data();
+    allocated_blocks_num++;
+    allocated_bytes_num -= _size_meta_data();
+    splits_num++;
+    size_t prev_size = block->size;
+    head_metadata_t* rest = (head_metadata_t*)((uint8_t*)block + block_size);
+    _init_sbrk_alloc_block(block, block_size);
+    if (arena->last == block) {
+        arena->last = rest;
+    }
+    rest->flags = 0;
+    _init_sbrk_free_block(arena, rest, prev_size - block_size);
+}
+
+// Challenge 2
+static head_metadata_t* _merge_sbrk_blocks(arena_t* arena, head_metadata_t* block, bool merge_left = true, bool merge_right = true, bool copy_data = false)
+{
+    size_t block_size_sum = block->size;
+    head_metadata_t* returned_block = block;
+    head_metadata_t* left_block = nullptr;
+    head_metadata_t* right_block = nullptr;
+    // only a free block before this one has a footer to find it by
+    if (merge_left && (BLOCK_FLAGS(block) & PREV_FREE)) {
+        size_t prev_block_size = *((size_t*)block - 1);
+        left_block = (head_metadata_t*)((uint8_t*)block - prev_block_size);
+        _check_cookie(left_block);
+    }
+    if (merge_right) {
+        right_block = _next_sbrk_block(arena, block);
+        if (right_block != nullptr) {
+            _check_cookie(right_block);
+        }
+    }
+    bool is_last = (block == arena->last);
+    if (left_block && BLOCK_STATE(left_block) == BLOCK_FREE) {
+        returned_block = left_block;
+        block_size_sum += left_block->size;
+        free_blocks_num--;
+        allocated_blocks_num--;
+        free_bytes_num -= left_block->size - _size_meta_data();
+        allocated_bytes_num += _size_meta_data();
+        coalesces_num++;
+        _remove_sbrk_free_block(arena, left_block);
+        _rover_absorbed(arena, block, left_block);
+        if (copy_data) {
+            memmove(BLOCK_PAYLOAD(left_block), BLOCK_PAYLOAD(block), block->size - _size_meta_data());
+        }
+    }
+    if (right_block && BLOCK_STATE(right_block) == BLOCK_FREE) {
+        block_size_sum += right_block->size;
+        free_blocks_num--;
+        allocated_blocks_num--;
+        free_bytes_num -= right_block->size - _size_meta_data();
+        allocated_bytes_num += _size_meta_data();
+        coalesces_num++;
+        is_last = is_last || (right_block == arena->last);
+        _remove_sbrk_free_block(arena, right_block);
+        _rover_absorbed(arena, right_block, returned_block);
+    }
+    if (is_last) {
+        arena->last = returned_block;
+    }
+    return _init_sbrk_alloc_block(returned_block, block_size_sum);
+}
+
+static void _remote_free_drain(arena_t* arena);
+static head_metadata_t* _quick_malloc(arena_t* arena, size_t block_size);
+static bool _quick_consolidate(arena_t* arena);
+
+static head_metadata_t* _sbrk_malloc(arena_t* arena, size_t block_size)
+{
+    head_metadata_t* last_block;
+    _remote_free_drain(arena);
+    if (arena->head) {
+        head_metadata_t* quick = _quick_malloc(arena, block_size);
+        if (quick) {
+            return quick;
+        }
+        // no bin has a block this large, merging the parked blocks may make one
+        if (_next_non_empty_bin(arena, _bin_index(block_size)) == BINS_NUM) {
+            _quick_consolidate(arena);
+        }
+        head_metadata_t* last_searched = _find_sbrk_free_block(arena, block_size);
+        if (last_searched) {
+            free_blocks_num--;
+            free_bytes_num -= last_searched->size - _size_meta_data();
+            _remove_sbrk_free_block(arena, last_searched);
+            _split_sbrk_block(arena, last_searched, block_size);
+            return last_searched;
+        }
+        head_metadata_t* wilderness = _grow_sbrk_wilderness(arena, block_size);
+        if (wilderness) {
+            return wilderness;
+        }
+    } else {
+        arena->head = (head_metadata_t*)_arena_sbrk(arena, 0);
+        if (arena->head == (head_metadata_t*)(-1)) {
+            arena->head = nullptr;
+            return nullptr;
+        }
+    }
+    last_block = (head_metadata_t*)_arena_sbrk(arena, block_size);
+    if (last_block == (head_metadata_t*)(-1)) {
+        return nullptr;
+    }
+    last_block->flags = 0;
+    if (arena->last != nullptr && BLOCK_STATE(arena->last) == BLOCK_FREE) {
+        SET_PREV_FREE(last_block, true);
+    }
+    arena->last = last_block;
+    _init_sbrk_alloc_block(last_block, block_size);
+    allocated_blocks_num++;
+    allocated_bytes_num += block_size - _size_meta_data();
+    return last_block;
+}
+
+// Drop the pages of a free block that lie between from and to, its header, tree links and footer stay resident
+static bool _release_free_block_range(head_metadata_t* block, uint8_t* from, uint8_t* to)
+{
+    uint8_t* interior = (uint8_t*)block + sizeof(head_metadata_t) + sizeof(tree_node_t);
+    uintptr_t start = PAGE_ALIGN_UP((from > interior) ? from : interior);
+    uint8_t* footer = (uint8_t*)FOOTER(block);
+    uintptr_t end = PAGE_ALIGN_DOWN((to < footer) ? to : footer);
+    if (end <= start) {
+        return false;
+    }
+    return madvise((void*)start, end - start, MADV_DONTNEED) == 0;
+}
+
+static bool _release_free_block_pages(head_metadata_t* block)
+{
+    return _release_free_block_range(block, (uint8_t*)block, (uint8_t*)block + block->size);
+}
+
+// Shrink the free wilderness block to pad bytes of payload and move the program break back.
+// The block before it has no footer to become the new wilderness by, so the wilderness
+// is only removed when pad is 0 and it is the whole heap. Returns the number of bytes given back.
+static size_t _trim_wilderness(arena_t* arena, head_metadata_t* wilderness, size_t pad)
+{
+    size_t keep_size = _8_bit_align(pad) + _size_meta_data();
+    if (pad == 0 && wilderness == arena->head) {
+        keep_size = 0;
+    } else if (keep_size < MIN_BLOCK_SIZE) {
+        keep_size = MIN_BLOCK_SIZE;
+    }
+    if (keep_size >= wilderness->size) {
+        return 0;
+    }
+    size_t release_size = wilderness->size - keep_size;
+    _remove_sbrk_free_block(arena, wilderness);
+    if (keep_size == 0) {
+        free_blocks_num--;
+        allocated_blocks_num--;
+        free_bytes_num -= wilderness->size - _size_meta_data();
+        allocated_bytes_num -= wilderness->size - _size_meta_data();
+        arena->last = nullptr;
+    } else {
+        free_bytes_num -= release_size;
+        allocated_bytes_num -= release_size;
+        _init_sbrk_free_block(arena, wilderness, keep_size);
+    }
+    _arena_sbrk(arena, -(intptr_t)release_size);
+    return release_size;
+}
+
+static bool _trim_arena(arena_t* arena, size_t pad)
+{
+    bool released = false;
+    _quick_consolidate(arena);
+    head_metadata_t* wilderness = _sbrk_wilderness_block(arena);
+    if (wilderness != nullptr && BLOCK_STATE(wilderness) == BLOCK_FREE) {
+        released = _trim_wilderness(arena, wilderness, pad) > 0;
+    }
+    // small bin blocks are shorter than a page
+    for (size_t i = SMALL_BINS_NUM; i < BINS_NUM; i++) {
+        for (head_metadata_t* block = _tree_lower_bound(arena->bins[i], 0); block != nullptr; block = _tree_next(block)) {
+            released = _release_free_block_pages(block) || released;
+        }
+    }
+    return released;
+}
+
+static void _coalescing_free(arena_t* arena, head_metadata_t* block)
+{
+    uint8_t* freed_start = (uint8_t*)block;
+    uint8_t* freed_end = freed_start + block->size;
+    block = _merge_sbrk_blocks(arena, block);
+    free_blocks_num++;
+    free_bytes_num += block->size - _size_meta_data();
+    _add_sbrk_free_block(arena, block);
+    // The wilderness is only cut back by a page or more, so the break does not move for a few bytes.
+    // A block inside the heap is usually split again soon, dropping its pages costs a fault on every
+    // page it hands out after that, so it has to be much larger. Only the pages of the freed block are
+    // dropped, merging into a large free block does not release that block again, strim does.
+    if (block == arena->last) {
+        if (block->size >= TRIM_THRESHOLD && block->size >= TRIM_PAD + _size_meta_data() + REGULAR_PAGE_SIZE) {
+            _trim_wilderness(arena, block, TRIM_PAD);
+        }
+    } else if (block->size >= RELEASE_THRESHOLD) {
+        _release_free_block_range(block, freed_start, freed_end);
+    }
+}
+
+#ifdef MALLOC_DEFERRED_COALESCING
+// Small blocks are parked in the quick lists of their arena instead of being merged, so a size
+// that is freed and allocated again in turn is not merged and split again every time.
+// They count as free and their neighbours see them like blocks in a thread cache.
+static void _quick_push(arena_t* arena, head_metadata_t* block)
+{
+    free_blocks_num++;
+    free_bytes_num += block->size - _size_meta_data();
+    quick_blocks_num++;
+    SET_BLOCK_STATE(block, BLOCK_CACHED);
+    head_metadata_t** list = &arena->quick[block->size / 8];
+    block->next = *list;
+    *list = block;
+    arena->quick_bytes += block->size;
+}
+
+// only a block of exactly block_size is taken, anything else would have to be split
+static head_metadata_t* _quick_malloc(arena_t* arena, size_t block_size)
+{
+    if (block_size >= QUICK_LIMIT || arena->quick[block_size / 8] == nullptr) {
+        return nullptr;
+    }
+    head_metadata_t* block = arena->quick[block_size / 8];
+    _check_cookie(block);
+    arena->quick[block_size / 8] = block->next;
+    arena->quick_bytes -= block->size;
+    free_blocks_num--;
+    free_bytes_num -= block->size - _size_meta_data();
+    quick_blocks_num--;
+    SET_BLOCK_STATE(block, BLOCK_ALLOCATED);
+    return block;
+}
+
+// Merges every parked block of the arena with its free neighbours into the bins.
+// Parked neighbours are merged too, each one as its turn comes.
+static bool _quick_consolidate(arena_t* arena)
+{
+    if (arena->quick_bytes == 0) {
+        return false;
+    }
+    for (size_t i = 0; i < QUICK_BINS_NUM; i++) {
+        while (arena->quick[i] != nullptr) {
+            head_metadata_t* block = arena->quick[i];
+            arena->quick[i] = block->next;
+            free_blocks_num--;
+            free_bytes_num -= block->size - _size_meta_data();
+            quick_blocks_num--;
+            SET_BLOCK_STATE(block, BLOCK_ALLOCATED);
+            _coalescing_free(arena, block);
+        }
+    }
+    arena->quick_bytes = 0;
+    consolidations_num++;
+    return true;
+}
+
+void _sbrk_free(arena_t* arena, head_metadata_t* block)
+{
+    if (block->size >= QUICK_LIMIT) {
+        _coalescing_free(arena, block);
+        return;
+    }
+    _quick_push(arena, block);
+    if (arena->quick_bytes >= QUICK_CONSOLIDATE_BYTES) {
+        _quick_consolidate(arena);
+    }
+}
+#else
+static head_metadata_t* _quick_malloc(arena_t*, size_t)
+{
+    return nullptr;
+}
+
+static bool _quick_consolidate(arena_t*)
+{
+    return false;
+}
+
+void _sbrk_free(arena_t* arena, head_metadata_t* block)
+{
+    _coalescing_free(arena, block);
+}
+#endif
+
+// Takes a block with room for the alignment slack and frees the part in front of the aligned payload.
+// That part is made at least MIN_BLOCK_SIZE long so it can stand as a free block of its own.
+static head_metadata_t* _sbrk_aligned_malloc(arena_t* arena, size_t block_size, size_t alignment)
+{
+    head_metadata_t* block = _sbrk_malloc(arena, block_size + alignment + MIN_BLOCK_SIZE);
+    if (block == nullptr) {
+        return nullptr;
+    }
+    uintptr_t payload = (uintptr_t)BLOCK_PAYLOAD(block);
+    size_t lead_size = ((payload + alignment - 1) & ~(alignment - 1)) - payload;
+    if (lead_size != 0) {
+        while (lead_size < MIN_BLOCK_SIZE) {
+            lead_size += alignment;
+        }
+        head_metadata_t* aligned = (head_metadata_t*)((uint8_t*)block + lead_size);
+        aligned->flags = 0;
+        _init_sbrk_alloc_block(aligned, block->size - lead_size);
+        if (arena->last == block) {
+            arena->last = aligned;
+        }
+        _init_sbrk_alloc_block(block, lead_size);
+        allocated_blocks_num++;
+        allocated_bytes_num -= _size_meta_data();
+        splits_num++;
+        _sbrk_free(arena, block);
+        block = aligned;
+    }
+    _split_sbrk_block(arena, block, block_size);
+    return block;
+}
+
+// Cuts count blocks of block_size out of one free block or the wilderness and writes their payloads to out.
+// The last block keeps the slack when what is left of the run is too small to split off.
+static bool _sbrk_malloc_run(arena_t* arena, size_t block_size, size_t count, void** out)
+{
+    head_metadata_t* run = _sbrk_malloc(arena, block_size * count);
+    if (run == nullptr) {
+        return false;
+    }
+    bool is_last = (arena->last == run);
+    size_t run_size = run->size;
+    head_metadata_t* block = run;
+    for (size_t i = 0; i < count; i++) {
+        if (i != 0) {
+            block = (head_metadata_t*)((uint8_t*)block + block_size);
+            block->flags = 0;
+        }
+        _init_sbrk_alloc_block(block, (i == count - 1) ? run_size - i * block_size : block_size);
+        out[i] = BLOCK_PAYLOAD(block);
+    }
+    if (is_last) {
+        arena->last = block;
+    }
+    allocated_blocks_num += count - 1;
+    allocated_bytes_num -= (count - 1) * _size_meta_data();
+    splits_num += count - 1;
+    return true;
+}
+
+#ifdef MALLOC_THREAD_SAFE
+static void _tcache_register()
+{
+    if (!tcache.registered) {
+        tcache.registered = true;
+        pthread_setspecific(tcache_key, &tcache);
+    }
+}
+
+// moves up to TCACHE_REFILL free blocks of exactly block_size from the arena bins, has to be called under the arena lock
+static void _tcache_refill(arena_t* arena, tcache_bin_t* bin, size_t block_size)
+{
+    size_t index = _bin_index(block_size);
+    _remote_free_drain(arena);
+    while (bin->count < TCACHE_REFILL && arena->bins[index] != nullptr) {
+        head_metadata_t* block = _small_bin_first(arena->bins[index]);
+        _remove_sbrk_free_block(arena, block);
+        SET_BLOCK_STATE(block, BLOCK_CACHED);
+        block->next = bin->head;
+        bin->head = block;
+        bin->count++;
+    }
+    if (bin->count != 0) {
+        _tcache_register();
+    }
+}
+
+static bool _remote_free_push(arena_t* arena, head_metadata_t* block);
+
+// returns up to count cached blocks to the arenas they came from
+static void _tcache_flush(tcache_bin_t* bin, size_t count)
+{
+    while (count-- > 0 && bin->head != nullptr) {
+        head_metadata_t* block = bin->head;
+        arena_t* arena = _block_arena(block);
+        bin->head = block->next;
+        bin->count--;
+        if (_remote_free_push(arena, block)) {
+            continue;
+        }
+        free_blocks_num--;
+        free_bytes_num -= block->size - _size_meta_data();
+        SET_BLOCK_STATE(block, BLOCK_ALLOCATED);
+        ARENA_LOCK(arena);
+        _sbrk_free(arena, block);
+        ARENA_UNLOCK(arena);
+    }
+}
+
+static void _tcache_destroy(void* cache)
+{
+    tcache_t* thread_cache = (tcache_t*)cache;
+    for (size_t i = 0; i < TCACHE_BINS_NUM; i++) {
+        _tcache_flush(&thread_cache->bins[i], TCACHE_COUNT);
+    }
+    thread_cache->registered = false;
+}
+
+// The cached blocks belong to the calling thread only, so hits take no lock.
+// Other threads may read the state of a cached block while merging its neighbours,
+// but they only act on BLOCK_FREE which is set under the arena lock.
+static head_metadata_t* _tcache_malloc(arena_t* arena, size_t block_size)
+{
+    head_metadata_t* block;
+    if (block_size >= TCACHE_LIMIT) {
+        return nullptr;
+    }
+    tcache_bin_t* bin = &tcache.bins[block_size / 8];
+    if (bin->count == 0) {
+        ARENA_LOCK(arena);
+        _tcache_refill(arena, bin, block_size);
+        block = (bin->count == 0) ? _sbrk_malloc(arena, block_size) : nullptr;
+        ARENA_UNLOCK(arena);
+        if (bin->count == 0) {
+            return block;
+        }
+    }
+    block = bin->head;
+    _check_cookie(block);
+    bin->head = block->next;
+    bin->count--;
+    block->next = nullptr;
+    SET_BLOCK_STATE(block, BLOCK_ALLOCATED);
+    free_blocks_num--;
+    free_bytes_num -= block->size - _size_meta_data();
+    return block;
+}
+
+static bool _tcache_free(head_metadata_t* block)
+{
+    if (block->size >= TCACHE_LIMIT) {
+        return false;
+    }
+    tcache_bin_t* bin = &tcache.bins[block->size / 8];
+    if (bin->count == TCACHE_COUNT) {
+        _tcache_flush(bin, TCACHE_COUNT / 2);
+    }
+    free_blocks_num++;
+    free_bytes_num += block->size - _size_meta_data();
+    SET_BLOCK_STATE(block, BLOCK_CACHED);
+    block->next = bin->head;
+    bin->head = block;
+    bin->count++;
+    _tcache_register();
+    return true;
+}
+
+// Blocks a thread frees into the arena of other threads wait on a lock-free stack of that arena,
+// the next thread that takes the arena lock to allocate frees them all. They count as free meanwhile,
+// like blocks in a thread cache. Blocks are only pushed one by one and only taken all at once, so there is no ABA.
+// Returns false for a block of the arena of the calling thread, it is cheaper to free under the lock.
+static bool _remote_free_push(arena_t* arena, head_metadata_t* block)
+{
+#ifdef MALLOC_NO_REMOTE_FREE
+    (void)arena;
+    (void)block;
+    return false;
+#else
+    if (arena == thread_arena) {
+        return false;
+    }
+    if (BLOCK_STATE(block) != BLOCK_CACHED) {
+        free_blocks_num++;
+        free_bytes_num += block->size - _size_meta_data();
+        SET_BLOCK_STATE(block, BLOCK_CACHED);
+    }
+    head_metadata_t* head = __atomic_load_n(&arena->remote_frees, __ATOMIC_RELAXED);
+    do {
+        block->next = head;
+    } while (!__atomic_compare_exchange_n(&arena->remote_frees, &head, block, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    return true;
+#endif
+}
+
+// has to be called under the arena lock
+static void _remote_free_drain(arena_t* arena)
+{
+    if (__atomic_load_n(&arena->remote_frees, __ATOMIC_RELAXED) == nullptr) {
+        return;
+    }
+    head_metadata_t* block = __atomic_exchange_n(&arena->remote_frees, (head_metadata_t*)nullptr, __ATOMIC_ACQUIRE);
+    while (block != nullptr) {
+        head_metadata_t* next = block->next;
+        free_blocks_num--;
+        free_bytes_num -= block->size - _size_meta_data();
+        SET_BLOCK_STATE(block, BLOCK_ALLOCATED);
+        _sbrk_free(arena, block);
+        block = next;
+    }
+}
+#else
+static head_metadata_t* _tcache_malloc(arena_t*, size_t)
+{
+    return nullptr;
+}
+
+static bool _tcache_free(head_metadata_t*)
+{
+    return false;
+}
+
+static bool _remote_free_push(arena_t*, head_metadata_t*)
+{
+    return false;
+}
+
+static void _remote_free_drain(arena_t*)
+{
+}
+#endif
+
+#ifdef MALLOC_SLAB
+static bool _is_slab_object(void* p)
+{
+    return slab_base != nullptr && (uint8_t*)p >= slab_base && (uint8_t*)p < slab_base + SLAB_REGION_SIZE;
+}
+
+static size_t _slab_object_size(void* p)
+{
+    return SLAB_OF(p)->object_size;
+}
+
+static void _link_partial_slab(slab_class_t* slab_class, slab_t* slab)
+{
+    slab->prev = nullptr;
+    slab->next = slab_class->partial;
+    if (slab_class->partial) {
+        slab_class->partial->prev = slab;
+    }
+    slab_class->partial = slab;
+}
+
+static void _unlink_partial_slab(slab_class_t* slab_class, slab_t* slab)
+{
+    if (slab->prev) {
+        slab->prev->next = slab->next;
+    } else {
+        slab_class->partial = slab->next;
+    }
+    if (slab->next) {
+        slab->next->prev = slab->prev;
+    }
+    slab->next = nullptr;
+    slab->prev = nullptr;
+}
+
+// takes a page from the pool of empty slabs or from the end of the slab region
+static slab_t* _new_slab(size_t object_size)
+{
+    slab_t* slab = nullptr;
+#ifdef MALLOC_THREAD_SAFE
+    pthread_mutex_lock(&slab_pool_lock);
+#endif
+    if (empty_slabs != nullptr) {
+        slab = empty_slabs;
+        empty_slabs = slab->next;
+    } else if (slab_top + SLAB_SIZE <= slab_base + SLAB_REGION_SIZE) {
+        slab = (slab_t*)slab_top;
+        slab_top += SLAB_SIZE;
+    }
+#ifdef MALLOC_THREAD_SAFE
+    pthread_mutex_unlock(&slab_pool_lock);
+#endif
+    if (slab == nullptr) {
+        return nullptr;
+    }
+    size_t capacity = SLAB_CAPACITY(object_size);
+    slab->next = nullptr;
+    slab->prev = nullptr;
+    slab->object_size = object_size;
+    slab->free_objects = capacity;
+    for (size_t i = 0; i < SLAB_BITMAP_WORDS; i++) {
+        size_t bits = (capacity > i * 64) ? capacity - i * 64 : 0;
+        slab->free_map[i] = (bits >= 64) ? ~(uint64_t)0 : ((uint64_t)1 << bits) - 1;
+    }
+    slab_meta_data_bytes += sizeof(slab_t);
+    return slab;
+}
+
+static void _release_slab(slab_t* slab)
+{
+    slab_meta_data_bytes -= sizeof(slab_t);
+#ifdef MALLOC_THREAD_SAFE
+    pthread_mutex_lock(&slab_pool_lock);
+#endif
+    slab->next = empty_slabs;
+    empty_slabs = slab;
+#ifdef MALLOC_THREAD_SAFE
+    pthread_mutex_unlock(&slab_pool_lock);
+#endif
+}
+
+static void* _slab_malloc(size_t size)
+{
+    if (size > SLAB_LIMIT || slab_base == nullptr) {
+        return nullptr;
+    }
+    slab_class_t* slab_class = &slab_classes[size / 8 - 1];
+#ifdef MALLOC_THREAD_SAFE
+    pthread_mutex_lock(&slab_class->lock);
+#endif
+    slab_t* slab = slab_class->partial;
+    if (slab == nullptr) {
+        slab = _new_slab(size);
+        if (slab == nullptr) {
+#ifdef MALLOC_THREAD_SAFE
+            pthread_mutex_unlock(&slab_class->lock);
+#endif
+            return nullptr;
+        }
+        _link_partial_slab(slab_class, slab);
+    }
+    size_t word = 0;
+    while (slab->free_map[word] == 0) {
+        word++;
+    }
+    size_t index = word * 64 + __builtin_ctzll(slab->free_map[word]);
+    slab->free_map[word] &= slab->free_map[word] - 1;
+    if (--slab->free_objects == 0) {
+        _unlink_partial_slab(slab_class, slab);
+    }
+#ifdef MALLOC_THREAD_SAFE
+    pthread_mutex_unlock(&slab_class->lock);
+#endif
+    allocated_blocks_num++;
+    allocated_bytes_num += size;
+    slab_objects_num++;
+    return SLAB_OBJECTS(slab) + index * size;
+}
+
+static void _slab_free(void* p)
+{
+    slab_t* slab = SLAB_OF(p);
+    size_t object_size = slab->object_size;
+    size_t index = ((uint8_t*)p - SLAB_OBJECTS(slab)) / object_size;
+    uint64_t bit = (uint64_t)1 << (index % 64);
+    slab_class_t* slab_class = &slab_classes[object_size / 8 - 1];
+#ifdef MALLOC_THREAD_SAFE
+    pthread_mutex_lock(&slab_class->lock);
+#endif
+    if (slab->free_map[index / 64] & bit) {
+#ifdef MALLOC_THREAD_SAFE
+        pthread_mutex_unlock(&slab_class->lock);
+#endif
+        return;
+    }
+    slab->free_map[index / 64] |= bit;
+    if (++slab->free_objects == 1) {
+        _link_partial_slab(slab_class, slab);
+    } else if (slab->free_objects == SLAB_CAPACITY(object_size) && (slab->prev != nullptr || slab->next != nullptr)) {
+        // keep the last partial slab of the class so a lone object does not keep taking and releasing pages
+        _unlink_partial_slab(slab_class, slab);
+        _release_slab(slab);
+    }
+#ifdef MALLOC_THREAD_SAFE
+    pthread_mutex_unlock(&slab_class->lock);
+#endif
+    allocated_blocks_num--;
+    allocated_bytes_num -= object_size;
+    slab_objects_num--;
+}
+#else
+static bool _is_slab_object(void*)
+{
+    return false;
+}
+
+static size_t _slab_object_size(void*)
+{
+    return 0;
+}
+
+static void* _slab_malloc(size_t)
+{
+    return nullptr;
+}
+
+static void _slab_free(void*)
+{
+}
+#endif
+
+static size_t _mmap_length(size_t block_size, bool huge_page)
+{
+    size_t page_size = huge_page ? HUGE_PAGE_SIZE : REGULAR_PAGE_SIZE;
+    return (block_size + page_size - 1) & ~(page_size - 1);
+}
+
+static uint64_t _now_ns()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static void _mmap_cache_unlink(head_metadata_t* block)
+{
+    mmap_cache_node_t* node = MMAP_CACHE_NODE(block);
+    if (node->prev != nullptr) {
+        MMAP_CACHE_NODE(node->prev)->next = node->next;
+    } else {
+        mmap_cache[_bin_index(MMAP_LENGTH(block))] = node->next;
+    }
+    if (node->next != nullptr) {
+        MMAP_CACHE_NODE(node->next)->prev = node->prev;
+    }
+    mmap_cache_bytes -= MMAP_LENGTH(block);
+    __atomic_store_n(&mmap_cache_entries, mmap_cache_entries - 1, __ATOMIC_RELAXED);
+}
+
+static void _mmap_cache_release(head_metadata_t* block)
+{
+    _mmap_cache_unlink(block);
+    munmap(MMAP_START(block), MMAP_LENGTH(block));
+}
+
+// Unmap every mapping that has been idle longer than MMAP_CACHE_DECAY_NS
+static void _mmap_cache_decay(uint64_t now)
+{
+    if (now - mmap_cache_decayed_at < MMAP_CACHE_DECAY_NS / 4) {
+        return;
+    }
+    __atomic_store_n(&mmap_cache_decayed_at, now, __ATOMIC_RELAXED);
+    for (size_t i = 0; i < BINS_NUM && mmap_cache_entries > 0; i++) {
+        head_metadata_t* block = mmap_cache[i];
+        while (block != nullptr) {
+            head_metadata_t* next = MMAP_CACHE_NODE(block)->next;
+            if (now - MMAP_CACHE_NODE(block)->freed_at >= MMAP_CACHE_DECAY_NS) {
+                _mmap_cache_release(block);
+            }
+            block = next;
+        }
+    }
+}
+
+// Decays the cache from the sbrk paths too, a program that stops making mmap sized calls would keep
+// its cached mappings forever otherwise. Costs a load while the cache is empty and a coarse clock read
+// in between decays.
+static void _mmap_cache_tick()
+{
+    if (__atomic_load_n(&mmap_cache_entries, __ATOMIC_RELAXED) == 0) {
+        return;
+    }
+    if (_now_ns() - __atomic_load_n(&mmap_cache_decayed_at, __ATOMIC_RELAXED) < MMAP_CACHE_DECAY_NS / 4) {
+        return;
+    }
+    MMAP_CACHE_LOCK();
+    _mmap_cache_decay(_now_ns());
+    MMAP_CACHE_UNLOCK();
+}
+
+static void _mmap_cache_release_oldest()
+{
+    head_metadata_t* oldest = nullptr;
+    for (size_t i = 0; i < BINS_NUM; i++) {
+        for (head_metadata_t* block = mmap_cache[i]; block != nullptr; block = MMAP_CACHE_NODE(block)->next) {
+            if (oldest == nullptr || MMAP_CACHE_NODE(block)->freed_at < MMAP_CACHE_NODE(oldest)->freed_at) {
+                oldest = block;
+            }
+        }
+    }
+    if (oldest != nullptr) {
+        _mmap_cache_release(oldest);
+    }
+}
+
+// Reuse a cached mapping of at least length bytes from the bucket of length or the one above it,
+// so a reused mapping is never much longer than needed.
+static head_metadata_t* _mmap_cache_take(size_t length, bool huge_page)
+{
+    if (MMAP_CACHE_SIZE == 0) {
+        return nullptr;
+    }
+    head_metadata_t* found = nullptr;
+    MMAP_CACHE_LOCK();
+    _mmap_cache_decay(_now_ns());
+    size_t index = _bin_index(length);
+    for (size_t i = index; i < BINS_NUM && i <= index + 1 && found == nullptr; i++) {
+        for (head_metadata_t* block = mmap_cache[i]; block != nullptr; block = MMAP_CACHE_NODE(block)->next) {
+            if (MMAP_LENGTH(block) >= length && IS_HUGE_PAGE_TYPE(PAGE_TYPE(block)) == huge_page) {
+                found = block;
+                break;
+            }
+        }
+    }
+    if (found != nullptr) {
+        _mmap_cache_unlink(found);
+    }
+    MMAP_CACHE_UNLOCK();
+    return found;
+}
+
+// Keep a freed mapping for reuse, fails if the mapping is too large for the cache
+static bool _mmap_cache_put(head_metadata_t* block)
+{
+    size_t length = MMAP_LENGTH(block);
+    if (length > MMAP_CACHE_SIZE / 4) {
+        return false;
+    }
+    uint64_t now = _now_ns();
+    MMAP_CACHE_LOCK();
+    _mmap_cache_decay(now);
+    while (mmap_cache_entries >= MMAP_CACHE_ENTRIES || mmap_cache_bytes + length > MMAP_CACHE_SIZE) {
+        _mmap_cache_release_oldest();
+    }
+    SET_BLOCK_STATE(block, BLOCK_UNMAPPED);
+    size_t index = _bin_index(length);
+    mmap_cache_node_t* node = MMAP_CACHE_NODE(block);
+    node->freed_at = now;
+    node->prev = nullptr;
+    node->next = mmap_cache[index];
+    if (node->next != nullptr) {
+        MMAP_CACHE_NODE(node->next)->prev = block;
+    }
+    mmap_cache[index] = block;
+    mmap_cache_bytes += length;
+    __atomic_store_n(&mmap_cache_entries, mmap_cache_entries + 1, __ATOMIC_RELAXED);
+    MMAP_CACHE_UNLOCK();
+    return true;
+}
+
+// Challenge 6
+// Most hosts reserve no hugetlb pages, so a failed MAP_HUGETLB falls back to a 2MB aligned mapping
+// that asks for transparent huge pages, and to regular pages if the kernel refuses that too.
+static void* _mmap_huge_pages(size_t length, mmap_page_type_e* page_type)
+{
+    void* mmap_addr = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (mmap_addr != (void*)(-1)) {
+        *page_type = HUGE_PAGE;
+        return mmap_addr;
+    }
+    // map an extra huge page and cut the mapping down to a 2MB aligned range
+    mmap_addr = mmap(nullptr, length + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mmap_addr == (void*)(-1)) {
+        return mmap_addr;
+    }
+    uint8_t* start = (uint8_t*)mmap_addr;
+    uint8_t* aligned = (uint8_t*)(((uintptr_t)start + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1));
+    if (aligned != start) {
+        munmap(start, aligned - start);
+    }
+    if (aligned + length != start + length + HUGE_PAGE_SIZE) {
+        munmap(aligned + length, start + HUGE_PAGE_SIZE - aligned);
+    }
+    *page_type = (madvise(aligned, length, MADV_HUGEPAGE) == 0) ? TRANSPARENT_HUGE_PAGE : REGULAR_PAGE;
+    return aligned;
+}
+
+// Challenge 4
+// An aligned block gets alignment more bytes of mapping and starts as far into it as its payload needs.
+// zeroed, if given, tells whether the payload is still zero: it is unless the mapping came from the cache.
+static head_metadata_t* _mmap_malloc(size_t block_size, bool force_hugepage = false, size_t alignment = 0, bool* zeroed = nullptr)
+{
+    bool huge_page = force_hugepage || block_size >= HUGE_PAGE_LIMIT;
+    mmap_page_type_e page_type = REGULAR_PAGE;
+    size_t length = _mmap_length(sizeof(mmap_prefix_t) + block_size + alignment, huge_page);
+    uint8_t* start;
+    head_metadata_t* block = _mmap_cache_take(length, huge_page);
+    if (zeroed != nullptr) {
+        *zeroed = (block == nullptr);
+    }
+    if (block != nullptr) {
+        start = MMAP_START(block);
+        length = MMAP_LENGTH(block);
+        page_type = PAGE_TYPE(block);
+    } else {
+        void* mmap_addr;
+        if (huge_page) {
+            mmap_addr = _mmap_huge_pages(length, &page_type);
+        } else {
+            mmap_addr = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        }
+        if (mmap_addr == (void*)(-1)) {
+            return nullptr;
+        }
+        start = (uint8_t*)mmap_addr;
+    }
+    size_t offset = 0;
+    if (alignment != 0) {
+        uintptr_t payload = (uintptr_t)start + sizeof(mmap_prefix_t) + HEAD_SIZE;
+        offset = ((payload + alignment - 1) & ~(alignment - 1)) - payload;
+    }
+    block = (head_metadata_t*)(start + offset + sizeof(mmap_prefix_t));
+    // We use the sbrk function because it fits our needs (we don't call sbrk of course)
+    block->flags = 0;
+    _init_sbrk_alloc_block(block, block_size);
+    SET_BLOCK_STATE(block, BLOCK_MMAPPED);
+    PAGE_TYPE(block) = page_type;
+    MMAP_LENGTH(block) = length;
+    MMAP_PREFIX(block)->offset = offset;
+    mmap_blocks_num[page_type]++;
+    allocated_blocks_num++;
+    allocated_bytes_num += block_size - _size_meta_data();
+    return block;
+}
+
+static void _write_all(int fd, const char* buffer, size_t length)
+{
+    while (length > 0) {
+        ssize_t written = write(fd, buffer, length);
+        if (written <= 0) {
+            return;
+        }
+        buffer += written;
+        length -= written;
+    }
+}
+
+#ifdef MALLOC_PROFILE
+// Exponential gaps between samples make the sampled bytes a Poisson process over the allocated bytes
+static ssize_t _profile_next_interval()
+{
+    if (profile_random == 0) {
+        profile_random = ((uint64_t)(uintptr_t)&profile_random ^ _now_ns()) | 1;
+    }
+    profile_random ^= profile_random >> 12;
+    profile_random ^= profile_random << 25;
+    profile_random ^= profile_random >> 27;
+    double uniform = (((profile_random * 0x2545F4914F6CDD1DULL) >> 11) + 1) * (1.0 / 9007199254740992.0);
+    return (ssize_t)(-log(uniform) * __atomic_load_n(&profile_interval, __ATOMIC_RELAXED)) + 1;
+}
+
+// Finds or adds the slot of a backtrace, PROFILE_STACKS_NUM if the table is full. Called under the profile lock.
+static uint32_t _profile_stack(void** frames, size_t depth)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < depth; i++) {
+        hash = (hash ^ (uintptr_t)frames[i]) * 1099511628211ULL;
+    }
+    for (size_t i = 0; i < PROFILE_MAX_PROBE; i++) {
+        uint32_t index = (hash + i) & (PROFILE_STACKS_NUM - 1);
+        profile_stack_t* stack = &profile_stacks[index];
+        if (stack->depth == 0) {
+            stack->hash = hash;
+            memcpy(stack->frames, frames, depth * sizeof(void*));
+            __atomic_store_n(&stack->depth, depth, __ATOMIC_RELEASE);
+            return index;
+        }
+        if (stack->hash == hash && stack->depth == depth && memcmp(stack->frames, frames, depth * sizeof(void*)) == 0) {
+            return index;
+        }
+    }
+    return PROFILE_STACKS_NUM;
+}
+
+static size_t _profile_slot(void* p)
+{
+    return ((uintptr_t)p * 0x9E3779B97F4A7C15ULL) >> (64 - PROFILE_LIVE_BITS);
+}
+
+static profile_sample_t* _profile_probe(void* p, size_t i)
+{
+    return &profile_samples[(_profile_slot(p) + i) & (PROFILE_LIVE_NUM - 1)];
+}
+
+static void _profile_add(profile_stack_t* stack, ssize_t samples, ssize_t bytes)
+{
+    __atomic_fetch_add(&stack->live_samples, samples, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&stack->live_bytes, bytes, __ATOMIC_RELAXED);
+    if (samples > 0) {
+        __atomic_fetch_add(&stack->total_samples, samples, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&stack->total_bytes, bytes, __ATOMIC_RELAXED);
+    }
+}
+
+static __attribute__((noinline)) void _profile_sample(void* p, size_t size)
+{
+    if (profile_busy) {
+        return;
+    }
+    size_t interval = __atomic_load_n(&profile_interval, __ATOMIC_RELAXED);
+    if (interval == 0) {
+        profile_armed = false;
+        profile_countdown = PROFILE_RECHECK_BYTES;
+        return;
+    }
+    profile_countdown = _profile_next_interval();
+    // the countdown that ran out was not drawn with this interval
+    if (!profile_armed) {
+        profile_armed = true;
+        return;
+    }
+    profile_busy = true;
+    void* frames[PROFILE_DEPTH + PROFILE_SKIP];
+    int depth = backtrace(frames, PROFILE_DEPTH + PROFILE_SKIP) - PROFILE_SKIP;
+    // an allocation of size bytes is sampled with probability 1 - exp(-size / interval)
+    size_t weight = (size_t)(size / -expm1(-(double)size / interval));
+    PROFILE_LOCK();
+    uint32_t stack = (depth > 0) ? _profile_stack(frames + PROFILE_SKIP, depth) : PROFILE_STACKS_NUM;
+    for (size_t i = 0; i < PROFILE_MAX_PROBE && stack != PROFILE_STACKS_NUM; i++) {
+        profile_sample_t* sample = _profile_probe(p, i);
+        if (sample->p == nullptr || sample->p == PROFILE_TOMBSTONE) {
+            sample->weight = weight;
+            sample->stack = stack;
+            __atomic_store_n(&sample->p, p, __ATOMIC_RELEASE);
+            _profile_add(&profile_stacks[stack], 1, weight);
+            profile_live_samples++;
+            break;
+        }
+    }
+    PROFILE_UNLOCK();
+    profile_busy = false;
+}
+
+// The probe runs without the lock: a sample of p was added before p was returned, and nobody else frees p
+static void _profile_free(void* p)
+{
+    for (size_t i = 0; i < PROFILE_MAX_PROBE; i++) {
+        profile_sample_t* sample = _profile_probe(p, i);
+        void* sampled = __atomic_load_n(&sample->p, __ATOMIC_ACQUIRE);
+        if (sampled == nullptr) {
+            return;
+        }
+        if (sampled != p) {
+            continue;
+        }
+        PROFILE_LOCK();
+        _profile_add(&profile_stacks[sample->stack], -1, -(ssize_t)sample->weight);
+        profile_live_samples--;
+        // no probe goes on past an empty slot, so the removed slots right before one become empty too
+        if (_profile_probe(p, i + 1)->p != nullptr) {
+            __atomic_store_n(&sample->p, PROFILE_TOMBSTONE, __ATOMIC_RELEASE);
+        } else {
+            size_t index = sample - profile_samples;
+            do {
+                __atomic_store_n(&profile_samples[index].p, (void*)nullptr, __ATOMIC_RELEASE);
+                index = (index - 1) & (PROFILE_LIVE_NUM - 1);
+            } while (profile_samples[index].p == PROFILE_TOMBSTONE);
+        }
+        PROFILE_UNLOCK();
+        return;
+    }
+}
+
+static void _profile_signal_handler(int)
+{
+    int saved_errno = errno;
+    smalloc_profile_dump(profile_signal_fd);
+    errno = saved_errno;
+}
+#endif
+
+// Starts sampling about one allocation in every sample_interval bytes, 0 stops it.
+// Samples taken before a stop are kept until they are freed. Returns false without MALLOC_PROFILE.
+bool smalloc_profile_start(size_t sample_interval)
+{
+#ifdef MALLOC_PROFILE
+    // the first backtrace loads the unwinder, which allocates
+    void* frame;
+    profile_busy = true;
+    backtrace(&frame, 1);
+    profile_busy = false;
+    __atomic_store_n(&profile_interval, sample_interval, __ATOMIC_RELAXED);
+    return true;
+#else
+    (void)sample_interval;
+    return false;
+#endif
+}
+
+// Writes the live sampled bytes of every backtrace, most first. It takes no lock and does not allocate,
+// so a signal handler may call it.
+void smalloc_profile_dump(int fd)
+{
+    char buffer[256];
+#ifdef MALLOC_PROFILE
+    uint16_t order[PROFILE_STACKS_NUM];
+    size_t stacks = 0;
+    size_t live_samples = 0;
+    size_t live_bytes = 0;
+    for (size_t i = 0; i < PROFILE_STACKS_NUM; i++) {
+        if (__atomic_load_n(&profile_stacks[i].depth, __ATOMIC_ACQUIRE) != 0) {
+            order[stacks++] = i;
+            live_samples += __atomic_load_n(&profile_stacks[i].live_samples, __ATOMIC_RELAXED);
+            live_bytes += __atomic_load_n(&profile_stacks[i].live_bytes, __ATOMIC_RELAXED);
+        }
+    }
+    std::sort(order, order + stacks, [](uint16_t a, uint16_t b) {
+        return __atomic_load_n(&profile_stacks[a].live_bytes, __ATOMIC_RELAXED) > __atomic_load_n(&profile_stacks[b].live_bytes, __ATOMIC_RELAXED);
+    });
+    int length = snprintf(buffer, sizeof(buffer), "heap profile: %zu live bytes in %zu samples, sampling every %zu bytes\n",
+        live_bytes, live_samples, __atomic_load_n(&profile_interval, __ATOMIC_RELAXED));
+    _write_all(fd, buffer, length);
+    for (size_t i = 0; i < stacks; i++) {
+        profile_stack_t* stack = &profile_stacks[order[i]];
+        length = snprintf(buffer, sizeof(buffer), "\n%zu live bytes in %zu samples, %zu bytes allocated in %zu samples\n",
+            __atomic_load_n(&stack->live_bytes, __ATOMIC_RELAXED), __atomic_load_n(&stack->live_samples, __ATOMIC_RELAXED),
+            __atomic_load_n(&stack->total_bytes, __ATOMIC_RELAXED), __atomic_load_n(&stack->total_samples, __ATOMIC_RELAXED));
+        _write_all(fd, buffer, length);
+        backtrace_symbols_fd(stack->frames, stack->depth, fd);
+    }
+#else
+    int length = snprintf(buffer, sizeof(buffer), "heap profile: not built with MALLOC_PROFILE\n");
+    _write_all(fd, buffer, length);
+#endif
+}
+
+// Dumps the profile into fd whenever signal_number arrives
+bool smalloc_profile_dump_on_signal(int signal_number, int fd)
+{
+#ifdef MALLOC_PROFILE
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = _profile_signal_handler;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    profile_signal_fd = fd;
+    return sigaction(signal_number, &action, nullptr) == 0;
+#else
+    (void)signal_number;
+    (void)fd;
+    return false;
+#endif
+}
+
+// zero_from, if given, is set to where the payload is known to be zero up to its end,
+// nullptr if none of it is. scalloc clears only the payload before it.
+static void* _smalloc(size_t size, uint8_t** zero_from = nullptr)
+{
+    head_metadata_t* block;
+    bool zeroed = false;
+    uint8_t* clean = nullptr;
+    size = _8_bit_align(size);
+    if (size == 0 || size > SIZE_LIMIT) {
+        return nullptr;
+    }
+    size_t block_size = ALLOC_BLOCK_SIZE(size);
+    if (ALLOC_SBRK(block_size)) {
+        arena_t* arena = _thread_arena();
+        void* object = _slab_malloc(size);
+        if (object != nullptr) {
+            return object;
+        }
+        block = _tcache_malloc(arena, block_size);
+        if (block == nullptr) {
+            ARENA_LOCK(arena);
+            clean = arena->clean;
+            block = _sbrk_malloc(arena, block_size);
+            ARENA_UNLOCK(arena);
+            _mmap_cache_tick();
+            // the part of the block above the old high break was taken from the kernel just now
+            zeroed = (block != nullptr);
+        }
+    } else {
+        block = _mmap_malloc(block_size, false, 0, &zeroed);
+    }
+    if (block == nullptr) {
+        return nullptr;
+    }
+    if (zero_from != nullptr) {
+        *zero_from = nullptr;
+        if (zeroed) {
+            *zero_from = std::max((uint8_t*)BLOCK_PAYLOAD(block), clean);
+        }
+    }
+    return BLOCK_PAYLOAD(block);
+}
+
+void* smalloc(size_t size)
+{
+    void* p = _smalloc(size);
+    PROFILE_MALLOC(p, size);
+    return p;
+}
+
+// Only the memory that was handed out before is cleared, fresh pages from the kernel are zero already
+void* scalloc(size_t num, size_t size)
+{
+    void* alloc;
+    uint8_t* zero_from = nullptr;
+    if (size != 0 && num > SIZE_MAX / size) {
+        return nullptr;
+    }
+    size = _8_bit_align(num * size);
+    if (size == 0 || size > SIZE_LIMIT) {
+        return nullptr;
+    }
+    size_t block_size = ALLOC_BLOCK_SIZE(size);
+    if (block_size > SCALLOC_HUGE_PAGE_LIMIT + _size_meta_data()) {
+        bool zeroed;
+        head_metadata_t* block = _mmap_malloc(block_size, true, 0, &zeroed);
+        if (block == nullptr) {
+            return nullptr;
+        }
+        alloc = BLOCK_PAYLOAD(block);
+        zero_from = zeroed ? (uint8_t*)alloc : nullptr;
+    } else {
+        alloc = _smalloc(size, &zero_from);
+    }
+    if (alloc == nullptr) {
+        return nullptr;
+    }
+    if (zero_from == nullptr || zero_from > (uint8_t*)alloc + size) {
+        zero_from = (uint8_t*)alloc + size;
+    }
+    memset(alloc, 0, zero_from - (uint8_t*)alloc);
+    PROFILE_MALLOC(alloc, size);
+    return alloc;
+}
+
+void _mmap_free(head_metadata_t* block_to_free)
+{
+    allocated_blocks_num--;
+    allocated_bytes_num -= block_to_free->size - _size_meta_data();
+    mmap_blocks_num[PAGE_TYPE(block_to_free)]--;
+    if (!_mmap_cache_put(block_to_free)) {
+        munmap(MMAP_START(block_to_free), MMAP_LENGTH(block_to_free));
+    }
+}
+
+static void _free_block(head_metadata_t* block_to_free)
+{
+    _check_cookie(block_to_free);
+    size_t state = BLOCK_STATE(block_to_free);
+    if (state == BLOCK_FREE || state == BLOCK_CACHED || state == BLOCK_UNMAPPED) {
+        return;
+    }
+    if (IS_SBRK_ALLOC(block_to_free)) {
+        if (!_tcache_free(block_to_free)) {
+            arena_t* arena = _block_arena(block_to_free);
+            if (!_remote_free_push(arena, block_to_free)) {
+                ARENA_LOCK(arena);
+                _sbrk_free(arena, block_to_free);
+                ARENA_UNLOCK(arena);
+            }
+        }
+        _mmap_cache_tick();
+    } else {
+        _mmap_free(block_to_free);
+    }
+}
+
+static void _sfree(void* p)
+{
+    if (p == nullptr) {
+        return;
+    }
+    if (_is_slab_object(p)) {
+        _slab_free(p);
+        return;
+    }
+    _free_block(PAYLOAD_BLOCK(p));
+}
+
+void sfree(void* p)
+{
+    PROFILE_FREE(p);
+    _sfree(p);
+}
+
+size_t smalloc_usable_size(void* p)
+{
+    if (p == nullptr) {
+        return 0;
+    }
+    if (_is_slab_object(p)) {
+        return _slab_object_size(p);
+    }
+    // an allocated block has no footer, its payload runs up to the next header
+    return PAYLOAD_BLOCK(p)->size - _size_meta_data();
+}
+
+// size is the size p was allocated with. Sizes above the slab classes never look for a slab,
+// with MALLOC_HARDENED a size that does not fit the block is treated like a broken cookie.
+// Without MALLOC_SLAB this is sfree: a block may keep the tail of the free block it was cut from,
+// so its bin and thread cache bin are only known from its header.
+void sfree_sized(void* p, size_t size)
+{
+    if (p == nullptr) {
+        return;
+    }
+    PROFILE_FREE(p);
+    size = _8_bit_align(size);
+#ifdef MALLOC_HARDENED
+    if (size > smalloc_usable_size(p)) {
+        exit(0xdeadbeef);
+    }
+#endif
+    if (size <= SLAB_LIMIT && _is_slab_object(p)) {
+        _slab_free(p);
+        return;
+    }
+    _free_block(PAYLOAD_BLOCK(p));
+}
+
+// sbrk blocks are cut from a single run instead of being searched for one at a time
+static size_t _smalloc_batch(size_t size, size_t n, void** out)
+{
+    size_t done = 0;
+    size = _8_bit_align(size);
+    if (size == 0 || size > SIZE_LIMIT) {
+        return 0;
+    }
+    size_t block_size = ALLOC_BLOCK_SIZE(size);
+    if (!ALLOC_SBRK(block_size)) {
+        while (done < n && (out[done] = _smalloc(size)) != nullptr) {
+            done++;
+        }
+        return done;
+    }
+    arena_t* arena = _thread_arena();
+    while (done < n && (out[done] = _slab_malloc(size)) != nullptr) {
+        done++;
+    }
+    size_t run_limit = (size_t)SIZE_LIMIT / block_size;
+    ARENA_LOCK(arena);
+    while (done < n) {
+        size_t count = (n - done < run_limit) ? n - done : run_limit;
+        if (!_sbrk_malloc_run(arena, block_size, count, out + done)) {
+            break;
+        }
+        done += count;
+    }
+    ARENA_UNLOCK(arena);
+    return done;
+}
+
+// Fills out with up to n blocks of size bytes and returns how many were allocated
+size_t smalloc_batch(size_t size, size_t n, void** out)
+{
+    size_t done = _smalloc_batch(size, n, out);
+    for (size_t i = 0; i < done; i++) {
+        PROFILE_MALLOC(out[i], size);
+    }
+    return done;
+}
+
+// Frees n blocks and sorts ptrs by address on the way. sbrk blocks that lie next to each other
+// are joined before they are freed, so every run costs one merge and one bin insert.
+void sfree_batch(void** ptrs, size_t n)
+{
+    arena_t* locked = nullptr;
+    std::sort(ptrs, ptrs + n, std::less<void*>());
+    for (size_t i = 0; i < n; i++) {
+        void* p = ptrs[i];
+        if (p == nullptr || (i != 0 && p == ptrs[i - 1])) {
+            continue;
+        }
+        PROFILE_FREE(p);
+        if (_is_slab_object(p)) {
+            _slab_free(p);
+            continue;
+        }
+        head_metadata_t* block = PAYLOAD_BLOCK(p);
+        _check_cookie(block);
+        if (BLOCK_STATE(block) == BLOCK_MMAPPED) {
+            _mmap_free(block);
+            continue;
+        }
+        if (BLOCK_STATE(block) != BLOCK_ALLOCATED) {
+            continue;
+        }
+        arena_t* arena = _block_arena(block);
+        if (arena != locked) {
+            if (locked != nullptr) {
+                ARENA_UNLOCK(locked);
+            }
+            ARENA_LOCK(arena);
+            locked = arena;
+        }
+        size_t run_size = block->size;
+        size_t merged = 0;
+        head_metadata_t* last = block;
+        while (i + 1 < n && last != arena->last && ptrs[i + 1] == BLOCK_PAYLOAD((uint8_t*)last + last->size)) {
+            head_metadata_t* next = PAYLOAD_BLOCK(ptrs[i + 1]);
+            _check_cookie(next);
+            if (BLOCK_STATE(next) != BLOCK_ALLOCATED) {
+                break;
+            }
+            PROFILE_FREE(ptrs[i + 1]);
+            run_size += next->size;
+            merged++;
+            _rover_absorbed(arena, next, block);
+            last = next;
+            i++;
+        }
+        if (merged != 0) {
+            if (last == arena->last) {
+                arena->last = block;
+            }
+            _init_sbrk_alloc_block(block, run_size);
+            allocated_blocks_num -= merged;
+            allocated_bytes_num += merged * _size_meta_data();
+            coalesces_num += merged;
+        }
+        _sbrk_free(arena, block);
+    }
+    if (locked != nullptr) {
+        ARENA_UNLOCK(locked);
+    }
+}
+
+// On failure block points to the (possibly merged) block that still holds the data
+static void* _sbrk_realloc(arena_t* arena, head_metadata_t*& block, size_t block_size)
+{
+    void* program_break = _arena_sbrk(arena, 0);
+    // Try to reuse the same block
     if (block->size >= block_size) {
         goto split_block_if_needed;
     }
     // Try to merge with lower address
-    block = _merge_sbrk_blocks(block, true, false, true);
+    block = _merge_sbrk_blocks(arena, block, true, false, true);
     if (block->size >= block_size) {
         goto split_block_if_needed;
     }
     // Is wilderness block
     if ((void*)((uint8_t*)block + block->size) == program_break) {
-        allocated_bytes_num += block_size - block->size;
-        block = _wilderness_sbrk_block_increase(block, block_size);
-        return (void*)((uint8_t*)block + sizeof(head_metadata_t));
+        size_t prev_size = block->size;
+        if (_wilderness_sbrk_block_increase(arena, block, block_size) == nullptr) {
+            return nullptr;
+        }
+        allocated_bytes_num += block_size - prev_size;
+        return BLOCK_PAYLOAD(block);
     }
     // Try to merge with higher address
-    block = _merge_sbrk_blocks(block, false, true, false);
+    block = _merge_sbrk_blocks(arena, block, false, true, false);
     if (block->size >= block_size) {
         goto split_block_if_needed;
     }
     // Try to merge 3 block all toghether
-    block = _merge_sbrk_blocks(block, true, true, true);
+    block = _merge_sbrk_blocks(arena, block, true, true, true);
     if (block->size >= block_size) {
-        return (void*)((uint8_t*)block + sizeof(head_metadata_t));
+        return BLOCK_PAYLOAD(block);
     }
     // Is wilderness block
     if ((void*)((uint8_t*)block + block->size) == program_break) {
-        allocated_bytes_num += block_size - block->size;
-        block = _wilderness_sbrk_block_increase(block, block_size);
-        return (void*)((uint8_t*)block + sizeof(head_metadata_t));
+        size_t prev_size = block->size;
+        if (_wilderness_sbrk_block_increase(arena, block, block_size) == nullptr) {
+            return nullptr;
+        }
+        allocated_bytes_num += block_size - prev_size;
+        return BLOCK_PAYLOAD(block);
     }
     // If non of the options worked just allocate and copy to new block
     return nullptr;
 
 split_block_if_needed:
-    if (IS_REDUNDANT(block, block_size)) {
-        free_blocks_num++;
-        free_bytes_num += block->size - block_size - _size_meta_data();
-        allocated_blocks_num++;
-        allocated_bytes_num -= _size_meta_data();
-        size_t prev_size = block->size;
-        _init_sbrk_alloc_block(block, block_size, false);
-        _init_sbrk_free_block((head_metadata_t*)((uint8_t*)block + block_size), prev_size - block_size);
+    _split_sbrk_block(arena, block, block_size);
+    return BLOCK_PAYLOAD(block);
+}
+
+// Resize an mmap block with mremap so the kernel moves the pages instead of copying them.
+// A huge page block stays on huge pages, a regular one that grows past HUGE_PAGE_LIMIT
+// asks for transparent huge pages on its new range.
+static void* _mmap_realloc(head_metadata_t*& block, size_t block_size)
+{
+    mmap_page_type_e page_type = PAGE_TYPE(block);
+    bool huge_page = IS_HUGE_PAGE_TYPE(page_type) || block_size >= HUGE_PAGE_LIMIT;
+    size_t offset = MMAP_PREFIX(block)->offset;
+    size_t new_length = _mmap_length(offset + sizeof(mmap_prefix_t) + block_size, huge_page);
+    void* mremap_addr = mremap(MMAP_START(block), MMAP_LENGTH(block), new_length, MREMAP_MAYMOVE);
+    if (mremap_addr == (void*)(-1)) {
+        return nullptr;
+    }
+    // the old address may be unmapped now, the header moved with the pages
+    block = (head_metadata_t*)((uint8_t*)mremap_addr + offset + sizeof(mmap_prefix_t));
+    if (huge_page && page_type == REGULAR_PAGE && madvise(mremap_addr, new_length, MADV_HUGEPAGE) == 0) {
+        mmap_blocks_num[REGULAR_PAGE]--;
+        mmap_blocks_num[TRANSPARENT_HUGE_PAGE]++;
+        PAGE_TYPE(block) = TRANSPARENT_HUGE_PAGE;
     }
-    return (void*)((uint8_t*)block + sizeof(head_metadata_t));
+    allocated_bytes_num += block_size - block->size;
+    block->size = block_size;
+    MMAP_LENGTH(block) = new_length;
+    return BLOCK_PAYLOAD(block);
 }
 
-void* srealloc(void* oldp, size_t size)
+static void* _srealloc(void* oldp, size_t size)
 {
     void* newp;
     size = _8_bit_align(size);
     if (oldp == nullptr) {
-        return smalloc(size);
+        return _smalloc(size);
     }
-    head_metadata_t* old_block = (head_metadata_t*)((uint8_t*)oldp - sizeof(head_metadata_t));
     if (size == 0 || size > SIZE_LIMIT) {
         return nullptr;
     }
-    size_t block_size = size + _size_meta_data();
+    if (_is_slab_object(oldp)) {
+        size_t object_size = _slab_object_size(oldp);
+        if (size <= object_size) {
+            return oldp;
+        }
+        newp = _smalloc(size);
+        if (newp == nullptr) {
+            return nullptr;
+        }
+        memmove(newp, oldp, object_size);
+        _sfree(oldp);
+        return newp;
+    }
+    head_metadata_t* old_block = PAYLOAD_BLOCK(oldp);
+    size_t block_size = ALLOC_BLOCK_SIZE(size);
     if (IS_SBRK_ALLOC(old_block)) {
-        newp = _sbrk_realloc(old_block, block_size);
+        arena_t* arena = _block_arena(old_block);
+        ARENA_LOCK(arena);
+        newp = _sbrk_realloc(arena, old_block, block_size);
+        ARENA_UNLOCK(arena);
         if (newp) {
             return newp;
         }
+        // the in place attempt may have merged the block with its neighbours and moved the data
+        oldp = BLOCK_PAYLOAD(old_block);
     }
     if (old_block->size == block_size) {
         return oldp;
     }
-    if (!IS_SBRK_ALLOC(old_block) && old_block->next == (head_metadata_t*)HUGE_PAGE) {
+    if (!IS_SBRK_ALLOC(old_block) && !ALLOC_SBRK(block_size)) {
+        newp = _mmap_realloc(old_block, block_size);
+        if (newp) {
+            return newp;
+        }
+    }
+    if (!IS_SBRK_ALLOC(old_block) && IS_HUGE_PAGE_TYPE(PAGE_TYPE(old_block))) {
         head_metadata_t* block;
         block = _mmap_malloc(block_size, true);
         if (block == nullptr) {
             return nullptr;
         }
-        newp = (block) ? (void*)((uint8_t*)block + sizeof(head_metadata_t)) : nullptr;
+        newp = (block) ? BLOCK_PAYLOAD(block) : nullptr;
     } else {
-        newp = smalloc(size);
+        newp = _smalloc(size);
+    }
+    if (newp == nullptr) {
+        return nullptr;
     }
+    size_t old_size = old_block->size - _size_meta_data();
+    memmove(newp, oldp, (old_size < size) ? old_size : size);
+    _sfree(oldp);
+    return newp;
+}
+
+// A realloc is profiled as a free of the old block and an allocation of the new one. The sample of oldp
+// is dropped first: once _srealloc freed or moved the block, another thread may be handed its address.
+// A block that could not be reallocated is still live and is sampled again.
+void* srealloc(void* oldp, size_t size)
+{
+    PROFILE_FREE(oldp);
+    void* newp = _srealloc(oldp, size);
     if (newp == nullptr) {
+        PROFILE_MALLOC(oldp, smalloc_usable_size(oldp));
         return nullptr;
     }
-    memmove(newp, oldp, size);
-    sfree(oldp);
+    PROFILE_MALLOC(newp, size);
     return newp;
 }
+
+// alignment is a power of two, up to MALLOC_ALIGNMENT every block is aligned already
+static void* _aligned_malloc(size_t alignment, size_t size)
+{
+    head_metadata_t* block;
+    size = _8_bit_align(size);
+    if (size == 0 || size > SIZE_LIMIT || alignment > SIZE_LIMIT) {
+        return nullptr;
+    }
+    if (alignment <= MALLOC_ALIGNMENT) {
+        return smalloc(size);
+    }
+    size_t block_size = ALLOC_BLOCK_SIZE(size);
+    // slab objects and thread cache blocks are passed over, their addresses are not aligned
+    if (ALLOC_SBRK(block_size + alignment + MIN_BLOCK_SIZE)) {
+        arena_t* arena = _thread_arena();
+        ARENA_LOCK(arena);
+        block = _sbrk_aligned_malloc(arena, block_size, alignment);
+        ARENA_UNLOCK(arena);
+    } else {
+        block = _mmap_malloc(block_size, false, alignment);
+    }
+    void* p = (block) ? BLOCK_PAYLOAD(block) : nullptr;
+    PROFILE_MALLOC(p, size);
+    return p;
+}
+
+void* saligned_alloc(size_t alignment, size_t size)
+{
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0) {
+        return nullptr;
+    }
+    return _aligned_malloc(alignment, size);
+}
+
+// Like memalign, an alignment that is not a power of two is rounded up to one
+void* smemalign(size_t alignment, size_t size)
+{
+    size_t power = 1;
+    while (power < alignment && power <= SIZE_LIMIT) {
+        power <<= 1;
+    }
+    return _aligned_malloc(power, size);
+}
+
+int sposix_memalign(void** memptr, size_t alignment, size_t size)
+{
+    if (alignment == 0 || alignment % sizeof(void*) != 0 || (alignment & (alignment - 1)) != 0) {
+        return EINVAL;
+    }
+    if (size == 0) {
+        *memptr = nullptr;
+        return 0;
+    }
+    void* p = _aligned_malloc(alignment, size);
+    if (p == nullptr) {
+        return ENOMEM;
+    }
+    *memptr = p;
+    return 0;
+}
+
+// Regions hand out objects from chunks of chunk_size bytes and free them all at once,
+// 0 picks SARENA_CHUNK_SIZE. The chunks come from smalloc and stay allocated until the region is destroyed.
+sarena_t* sarena_create(size_t chunk_size)
+{
+    if (chunk_size == 0) {
+        chunk_size = SARENA_CHUNK_SIZE;
+    }
+    chunk_size = _8_bit_align(chunk_size);
+    if (chunk_size == 0 || chunk_size > SIZE_LIMIT) {
+        return nullptr;
+    }
+    sarena_t* region = (sarena_t*)_smalloc(sizeof(sarena_t));
+    if (region == nullptr) {
+        return nullptr;
+    }
+    memset(region, 0, sizeof(sarena_t));
+    region->chunk_size = chunk_size;
+    return region;
+}
+
+static sarena_chunk_t* _sarena_new_chunk(size_t size)
+{
+    sarena_chunk_t* chunk = (sarena_chunk_t*)_smalloc(sizeof(sarena_chunk_t) + size);
+    if (chunk == nullptr) {
+        return nullptr;
+    }
+    chunk->next = nullptr;
+    chunk->size = size;
+    region_bytes_num += size;
+    return chunk;
+}
+
+static void _sarena_free_chunks(sarena_chunk_t* chunk)
+{
+    while (chunk != nullptr) {
+        sarena_chunk_t* next = chunk->next;
+        region_bytes_num -= chunk->size;
+        _sfree(chunk);
+        chunk = next;
+    }
+}
+
+// Moves the bump pointer to the next chunk, a new one is added after the last
+static bool _sarena_next_chunk(sarena_t* region)
+{
+    sarena_chunk_t* chunk = (region->current != nullptr) ? region->current->next : region->chunks;
+    if (chunk == nullptr) {
+        chunk = _sarena_new_chunk(region->chunk_size);
+        if (chunk == nullptr) {
+            return false;
+        }
+        if (region->current != nullptr) {
+            region->current->next = chunk;
+        } else {
+            region->chunks = chunk;
+        }
+    }
+    region->current = chunk;
+    region->next = (uint8_t*)(chunk + 1);
+    region->end = region->next + chunk->size;
+    return true;
+}
+
+void* sarena_alloc(sarena_t* region, size_t size)
+{
+    size = _8_bit_align(size);
+    if (region == nullptr || size == 0 || size > SIZE_LIMIT) {
+        return nullptr;
+    }
+    if (size > region->chunk_size) {
+        sarena_chunk_t* chunk = _sarena_new_chunk(size);
+        if (chunk == nullptr) {
+            return nullptr;
+        }
+        chunk->next = region->large;
+        region->large = chunk;
+        region->used_bytes += size;
+        region_used_bytes_num += size;
+        return chunk + 1;
+    }
+    if ((size_t)(region->end - region->next) < size && !_sarena_next_chunk(region)) {
+        return nullptr;
+    }
+    void* p = region->next;
+    region->next += size;
+    region->used_bytes += size;
+    region_used_bytes_num += size;
+    return p;
+}
+
+// Frees every object of the region. The regular chunks are kept for the objects that come next.
+void sarena_reset(sarena_t* region)
+{
+    if (region == nullptr) {
+        return;
+    }
+    _sarena_free_chunks(region->large);
+    region->large = nullptr;
+    region->current = nullptr;
+    region->next = nullptr;
+    region->end = nullptr;
+    region_used_bytes_num -= region->used_bytes;
+    region->used_bytes = 0;
+}
+
+void sarena_destroy(sarena_t* region)
+{
+    if (region == nullptr) {
+        return;
+    }
+    sarena_reset(region);
+    _sarena_free_chunks(region->chunks);
+    _sfree(region);
+}
+
+// Give free memory back to the kernel: the free wilderness of every arena shrinks to pad bytes,
+// the pages inside the other free blocks are dropped and the mmap cache is emptied.
+// Returns 1 if any memory was released, like malloc_trim. Only the thread cache of the caller is flushed.
+int strim(size_t pad)
+{
+    bool released = false;
+#ifdef MALLOC_THREAD_SAFE
+    for (size_t i = 0; i < TCACHE_BINS_NUM; i++) {
+        _tcache_flush(&tcache.bins[i], TCACHE_COUNT);
+    }
+#endif
+    for (size_t i = 0; i < ARENAS_NUM; i++) {
+        arena_t* arena = &arenas[i];
+        ARENA_LOCK(arena);
+        if (arena->head != nullptr) {
+            _remote_free_drain(arena);
+            released = _trim_arena(arena, pad) || released;
+        }
+        ARENA_UNLOCK(arena);
+    }
+    MMAP_CACHE_LOCK();
+    for (size_t i = 0; i < BINS_NUM; i++) {
+        while (mmap_cache[i] != nullptr) {
+            _mmap_cache_release(mmap_cache[i]);
+            released = true;
+        }
+    }
+    MMAP_CACHE_UNLOCK();
+    return released ? 1 : 0;
+}
+
+// The payload of the largest free block of an arena, the last one of its highest non-empty bin
+// (any block of a small bin, they all have its size)
+static size_t _largest_free_block(arena_t* arena)
+{
+    for (size_t i = BINS_NUM; i-- > 0;) {
+        if ((arena->binmap[i / 64] & ((uint64_t)1 << (i % 64))) == 0) {
+            continue;
+        }
+        head_metadata_t* block = arena->bins[i];
+        if (i >= SMALL_BINS_NUM) {
+            while (TREE_NODE(block)->right != nullptr) {
+                block = TREE_NODE(block)->right;
+            }
+        }
+        return block->size - _size_meta_data();
+    }
+    return 0;
+}
+
+// Everything comes from counters kept up to date on every split, merge and bin change,
+// only the largest free block and the wilderness are read from the arenas.
+void smalloc_stats(smalloc_stats_t* stats)
+{
+    memset(stats, 0, sizeof(*stats));
+    for (size_t i = 0; i < ARENAS_NUM; i++) {
+        arena_t* arena = &arenas[i];
+        ARENA_LOCK(arena);
+        size_t largest = _largest_free_block(arena);
+        if (largest > stats->largest_free_block) {
+            stats->largest_free_block = largest;
+        }
+        if (arena->last != nullptr && BLOCK_STATE(arena->last) == BLOCK_FREE) {
+            stats->wilderness_bytes += arena->last->size - _size_meta_data();
+        }
+        ARENA_UNLOCK(arena);
+    }
+    for (size_t i = 0; i < SMALLOC_STATS_BUCKETS; i++) {
+        stats->free_histogram[i] = free_histogram[i];
+    }
+    stats->free_blocks = free_blocks_num;
+    stats->free_bytes = free_bytes_num;
+    stats->allocated_blocks = allocated_blocks_num;
+    stats->allocated_bytes = allocated_bytes_num;
+    stats->meta_data_bytes = _num_meta_data_bytes();
+    // the share of free memory that a request for the largest free block could not use
+    stats->external_fragmentation = (stats->free_bytes == 0) ? 0 : 1 - (double)stats->largest_free_block / stats->free_bytes;
+    stats->mmap_blocks = mmap_blocks_num[REGULAR_PAGE] + mmap_blocks_num[HUGE_PAGE] + mmap_blocks_num[TRANSPARENT_HUGE_PAGE];
+    stats->hugetlb_blocks = mmap_blocks_num[HUGE_PAGE];
+    stats->transparent_huge_page_blocks = mmap_blocks_num[TRANSPARENT_HUGE_PAGE];
+    MMAP_CACHE_LOCK();
+    stats->mmap_cache_bytes = mmap_cache_bytes;
+    MMAP_CACHE_UNLOCK();
+    stats->region_bytes = region_bytes_num;
+    stats->region_used_bytes = region_used_bytes_num;
+    stats->splits = splits_num;
+    stats->coalesces = coalesces_num;
+    stats->quick_blocks = quick_blocks_num;
+    stats->consolidations = consolidations_num;
+}
+
+// Formats into a buffer on the stack, so the dump never allocates and can run inside a preloaded program
+void smalloc_stats_dump(int fd)
+{
+    smalloc_stats_t stats;
+    char buffer[2048];
+    size_t length = 0;
+    smalloc_stats(&stats);
+    length += snprintf(buffer + length, sizeof(buffer) - length,
+        "allocated: %zu blocks, %zu bytes\n"
+        "free: %zu blocks, %zu bytes, largest %zu bytes, external fragmentation %.3f\n"
+        "wilderness: %zu bytes\n"
+        "meta data: %zu bytes\n"
+        "mmap: %zu blocks, %zu hugetlb, %zu transparent huge page, %zu bytes cached\n"
+        "regions: %zu bytes in chunks, %zu bytes used\n"
+        "splits: %zu, coalesces: %zu, consolidations: %zu, %zu blocks in quick lists\n"
+        "free blocks by size:\n",
+        stats.allocated_blocks, stats.allocated_bytes, stats.free_blocks, stats.free_bytes, stats.largest_free_block,
+        stats.external_fragmentation, stats.wilderness_bytes, stats.meta_data_bytes, stats.mmap_blocks, stats.hugetlb_blocks,
+        stats.transparent_huge_page_blocks, stats.mmap_cache_bytes, stats.region_bytes, stats.region_used_bytes,
+        stats.splits, stats.coalesces, stats.consolidations, stats.quick_blocks);
+    for (size_t i = 0; i < SMALLOC_STATS_BUCKETS && length < sizeof(buffer); i++) {
+        if (stats.free_histogram[i] != 0) {
+            length += snprintf(buffer + length, sizeof(buffer) - length, "  %10zu+ %zu\n", (size_t)32 << i, stats.free_histogram[i]);
+        }
+    }
+    if (length > sizeof(buffer)) {
+        length = sizeof(buffer);
+    }
+    _write_all(fd, buffer, length);
+}
@@ -0,0 +1,73 @@
+#ifndef MALLOC_4_H_
+#define MALLOC_4_H_
+
+#include <cstddef>
+
+void* smalloc(size_t size);
+void* scalloc(size_t num, size_t size);
+void sfree(void* p);
+// Same as sfree, size is what p was allocated with. Only MALLOC_SLAB builds use it, to skip the slab lookup
+// for sizes no slab holds, MALLOC_HARDENED builds check it against the block.
+void sfree_sized(void* p, size_t size);
+size_t smalloc_usable_size(void* p);
+void* srealloc(void* oldp, size_t size);
+void* saligned_alloc(size_t alignment, size_t size);
+void* smemalign(size_t alignment, size_t size);
+int sposix_memalign(void** memptr, size_t alignment, size_t size);
+size_t smalloc_batch(size_t size, size_t n, void** out);
+void sfree_batch(void** ptrs, size_t n);
+int strim(size_t pad);
+
+// Request scoped regions: objects are bump allocated and freed together by sarena_reset or sarena_destroy
+typedef struct sarena sarena_t;
+sarena_t* sarena_create(size_t chunk_size);
+void* sarena_alloc(sarena_t* region, size_t size);
+void sarena_reset(sarena_t* region);
+void sarena_destroy(sarena_t* region);
+
+size_t _num_free_blocks();
+size_t _num_free_bytes();
+size_t _num_allocated_blocks();
+size_t _num_allocated_bytes();
+size_t _num_meta_data_bytes();
+size_t _size_meta_data();
+
+// mmap blocks by the huge page tier that served them
+size_t _num_hugetlb_blocks();
+size_t _num_transparent_huge_page_blocks();
+size_t _num_regular_page_blocks();
+
+#define SMALLOC_STATS_BUCKETS (24)
+
+// Heap shape, see smalloc_stats. Sizes are payload bytes.
+typedef struct {
+    size_t allocated_blocks; // same as _num_allocated_blocks, free blocks included
+    size_t allocated_bytes;
+    size_t free_blocks;
+    size_t free_bytes;
+    size_t meta_data_bytes;
+    size_t largest_free_block;
+    double external_fragmentation; // 1 - largest_free_block / free_bytes
+    size_t wilderness_bytes; // free blocks at the top of the arenas, they can grow in place
+    size_t free_histogram[SMALLOC_STATS_BUCKETS]; // free blocks in the bins, bucket i holds block sizes from 32 << i
+    size_t mmap_blocks;
+    size_t hugetlb_blocks;
+    size_t transparent_huge_page_blocks;
+    size_t mmap_cache_bytes;
+    size_t region_bytes; // chunks held by sarena regions, part of allocated_bytes
+    size_t region_used_bytes; // objects handed out by the regions
+    size_t splits; // blocks cut off a larger one
+    size_t coalesces; // blocks merged into a neighbour
+    size_t quick_blocks; // small blocks parked unmerged by MALLOC_DEFERRED_COALESCING, part of free_blocks
+    size_t consolidations; // times the quick lists were merged into the bins
+} smalloc_stats_t;
+
+void smalloc_stats(smalloc_stats_t* stats);
+void smalloc_stats_dump(int fd);
+
+// Sampling heap profiler, see MALLOC_PROFILE
+bool smalloc_profile_start(size_t sample_interval);
+void smalloc_profile_dump(int fd);
+bool smalloc_profile_dump_on_signal(int signal_number, int fd);
+
+#endif // MALLOC_4_H_
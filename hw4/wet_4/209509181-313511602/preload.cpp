@@ -0,0 +1,93 @@
+// Puts malloc_4 in place of the libc allocator of any dynamically linked program:
+//   LD_PRELOAD=./libmalloc_4.so ./smash
+// The library is built by "make preload" with MALLOC_THREAD_SAFE, MALLOC_MMAP_ARENAS, MALLOC_PROFILE and 16 byte payloads.
+// It is called before libc has finished starting up, so nothing in it may allocate through libc,
+// and its thread locals use the initial-exec model which needs no allocation on first access.
+// SMALLOC_PROFILE=<bytes> in the environment starts the sampling profiler with that mean interval,
+// SIGUSR2 then dumps the profile to stderr.
+#include <cerrno>
+#include <csignal>
+#include <cstdlib>
+#include <unistd.h>
+
+#include "malloc_4.h"
+
+#define EXPORT extern "C" __attribute__((visibility("default")))
+
+// smalloc fails a request for 0 bytes, while many programs take NULL from malloc as out of memory
+#define NONZERO_SIZE(size) ((size) == 0 ? 1 : (size))
+
+static void* _set_errno(void* p)
+{
+    if (p == nullptr) {
+        errno = ENOMEM;
+    }
+    return p;
+}
+
+__attribute__((constructor)) static void _start_profile()
+{
+    const char* interval = getenv("SMALLOC_PROFILE");
+    if (interval != nullptr && smalloc_profile_start(strtoull(interval, nullptr, 10))) {
+        smalloc_profile_dump_on_signal(SIGUSR2, STDERR_FILENO);
+    }
+}
+
+EXPORT void* malloc(size_t size)
+{
+    return _set_errno(smalloc(NONZERO_SIZE(size)));
+}
+
+EXPORT void free(void* p)
+{
+    sfree(p);
+}
+
+EXPORT void* calloc(size_t num, size_t size)
+{
+    if (num == 0 || size == 0) {
+        num = 1;
+        size = 1;
+    }
+    return _set_errno(scalloc(num, size));
+}
+
+EXPORT void* realloc(void* p, size_t size)
+{
+    if (p != nullptr && size == 0) {
+        sfree(p);
+        return nullptr;
+    }
+    return _set_errno(srealloc(p, NONZERO_SIZE(size)));
+}
+
+EXPORT int posix_memalign(void** memptr, size_t alignment, size_t size)
+{
+    return sposix_memalign(memptr, alignment, NONZERO_SIZE(size));
+}
+
+EXPORT void* aligned_alloc(size_t alignment, size_t size)
+{
+    return _set_errno(saligned_alloc(alignment, NONZERO_SIZE(size)));
+}
+
+EXPORT void* memalign(size_t alignment, size_t size)
+{
+    return _set_errno(smemalign(alignment, NONZERO_SIZE(size)));
+}
+
+EXPORT void* valloc(size_t size)
+{
+    return _set_errno(smemalign(sysconf(_SC_PAGESIZE), NONZERO_SIZE(size)));
+}
+
+EXPORT void* pvalloc(size_t size)
+{
+    size_t page_size = sysconf(_SC_PAGESIZE);
+    return _set_errno(smemalign(page_size, (NONZERO_SIZE(size) + page_size - 1) & ~(page_size - 1)));
+}
+
+EXPORT size_t malloc_usable_size(void* p)
+{
+    return smalloc_usable_size(p);
+}
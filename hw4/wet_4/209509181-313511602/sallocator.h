@@ -0,0 +1,166 @@
+#ifndef SALLOCATOR_H_
+#define SALLOCATOR_H_
+
+// C++ front ends of malloc_4: SPool<T> recycles objects of one type, SAllocator<T> lets the standard
+// containers allocate through smalloc.
+
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <new>
+#include <utility>
+
+#include "malloc_4.h"
+
+#define SPOOL_CHUNK_SIZE ((size_t)64 * 1024) // pools grow by chunks this large, below the mmap threshold
+
+// smalloc payloads are only as aligned as a pointer, stricter types go through smemalign
+static inline void* _sallocate(size_t size, size_t alignment)
+{
+    return (alignment > sizeof(void*)) ? smemalign(alignment, size) : smalloc(size);
+}
+
+// Objects of one type carved out of chunks from smalloc. A freed object goes on a free list and is handed out
+// again before the pool grows, the chunks are only freed with the pool, objects still alive are not destroyed then.
+// Like sarena regions, a pool is not thread safe.
+template <typename T>
+class SPool {
+public:
+    explicit SPool(size_t chunk_size = SPOOL_CHUNK_SIZE)
+        : chunks(nullptr), free_slots(nullptr), next(nullptr), end(nullptr), chunk_size(chunk_size)
+    {
+    }
+
+    SPool(const SPool&) = delete;
+    SPool& operator=(const SPool&) = delete;
+
+    ~SPool()
+    {
+        while (chunks != nullptr) {
+            chunk_t* chunk = chunks;
+            chunks = chunk->next;
+            sfree(chunk);
+        }
+    }
+
+    // memory for one object, nullptr if the pool cannot grow
+    T* allocate()
+    {
+        if (free_slots != nullptr) {
+            slot_t* slot = free_slots;
+            free_slots = slot->next;
+            return reinterpret_cast<T*>(slot);
+        }
+        if (next == end && !_grow()) {
+            return nullptr;
+        }
+        return reinterpret_cast<T*>(next++);
+    }
+
+    void deallocate(T* p)
+    {
+        if (p == nullptr) {
+            return;
+        }
+        slot_t* slot = reinterpret_cast<slot_t*>(p);
+        slot->next = free_slots;
+        free_slots = slot;
+    }
+
+    template <typename... Args>
+    T* create(Args&&... args)
+    {
+        T* p = allocate();
+        return (p == nullptr) ? nullptr : new (p) T(std::forward<Args>(args)...);
+    }
+
+    void destroy(T* p)
+    {
+        if (p != nullptr) {
+            p->~T();
+            deallocate(p);
+        }
+    }
+
+private:
+    union slot_t {
+        slot_t* next; // while the slot is on the free list
+        alignas(T) unsigned char object[sizeof(T)];
+    };
+
+    typedef struct chunk {
+        struct chunk* next;
+    } chunk_t;
+
+    // the slots of a chunk follow its header
+    static const size_t HEADER_SIZE = (sizeof(chunk_t) + alignof(slot_t) - 1) / alignof(slot_t) * alignof(slot_t);
+
+    bool _grow()
+    {
+        size_t slots_num = (chunk_size > HEADER_SIZE + sizeof(slot_t)) ? (chunk_size - HEADER_SIZE) / sizeof(slot_t) : 1;
+        chunk_t* chunk = static_cast<chunk_t*>(_sallocate(HEADER_SIZE + slots_num * sizeof(slot_t), alignof(slot_t)));
+        if (chunk == nullptr) {
+            return false;
+        }
+        chunk->next = chunks;
+        chunks = chunk;
+        next = reinterpret_cast<slot_t*>(reinterpret_cast<uint8_t*>(chunk) + HEADER_SIZE);
+        end = next + slots_num;
+        return true;
+    }
+
+    chunk_t* chunks;
+    slot_t* free_slots;
+    slot_t* next; // the unused slots of the newest chunk
+    slot_t* end;
+    size_t chunk_size;
+};
+
+// Standard allocator over smalloc. deallocate knows the size, so it frees through sfree_sized.
+// Allocators are stateless and all compare equal.
+template <typename T>
+class SAllocator {
+public:
+    typedef T value_type;
+
+    SAllocator() noexcept
+    {
+    }
+
+    template <typename U>
+    SAllocator(const SAllocator<U>&) noexcept
+    {
+    }
+
+    T* allocate(size_t n)
+    {
+        if (n > std::numeric_limits<size_t>::max() / sizeof(T)) {
+            throw std::bad_alloc();
+        }
+        // smalloc fails a request for 0 bytes
+        void* p = _sallocate((n == 0) ? 1 : n * sizeof(T), alignof(T));
+        if (p == nullptr) {
+            throw std::bad_alloc();
+        }
+        return static_cast<T*>(p);
+    }
+
+    void deallocate(T* p, size_t n) noexcept
+    {
+        sfree_sized(p, n * sizeof(T));
+    }
+};
+
+template <typename T, typename U>
+bool operator==(const SAllocator<T>&, const SAllocator<U>&) noexcept
+{
+    return true;
+}
+
+template <typename T, typename U>
+bool operator!=(const SAllocator<T>&, const SAllocator<U>&) noexcept
+{
+    return false;
+}
+
+#endif // SALLOCATOR_H_
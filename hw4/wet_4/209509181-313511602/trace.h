@@ -0,0 +1,35 @@
+#ifndef TRACE_H_
+#define TRACE_H_
+
+#include <cstdint>
+
+// Binary allocation trace, written by libmalloc_trace.so (trace_record.cpp) and read by bench/trace_replay.
+// The file is a trace_header_t followed by one trace_event_t per call, in the order the calls took effect.
+// Blocks are named by ids instead of addresses, an id is reused only after its block was freed,
+// so a replayer can keep the live blocks in an array as long as the highest id.
+#define TRACE_MAGIC "STRACE1"
+
+typedef enum {
+    TRACE_MALLOC,
+    TRACE_CALLOC,
+    TRACE_REALLOC, // arg is the id of the old block
+    TRACE_MEMALIGN, // arg is the alignment
+    TRACE_FREE
+} trace_op_e;
+
+typedef struct {
+    char magic[8];
+    uint32_t event_size; // sizeof(trace_event_t)
+    uint32_t reserved;
+} trace_header_t;
+
+typedef struct __attribute__((packed)) {
+    uint64_t time_ns; // since the recording started
+    uint64_t size; // bytes asked for, 0 for a free
+    uint32_t id;
+    uint32_t arg;
+    uint16_t thread; // threads are numbered in the order of their first call
+    uint8_t op;
+} trace_event_t;
+
+#endif // TRACE_H_
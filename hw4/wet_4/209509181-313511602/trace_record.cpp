@@ -0,0 +1,368 @@
+// Records the allocations of any dynamically linked program into a trace (see trace.h) while glibc keeps serving them:
+//   SMALLOC_TRACE=smash.trace LD_PRELOAD=./libmalloc_trace.so ./smash
+// The library is built by "make trace". Events are buffered and written out when the buffer fills up
+// and when the program exits, a program that ends in _exit or a signal loses the tail of its trace.
+// Only the process started with SMALLOC_TRACE records, its forked or executed children do not, unless the path
+// has a %p: every process that runs the library then records to the path with %p replaced by its pid.
+// Calls are serialized through one lock, realloc holds it across the libc call so no other thread
+// can be handed the old block before it is recorded as freed.
+// Like preload.cpp nothing in here may allocate through libc.
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+#define EXPORT extern "C" __attribute__((visibility("default")))
+
+#define TRACE_BUFFER_EVENTS (4096)
+#define TRACE_TABLE_BITS (24)
+#define TRACE_TABLE_SIZE ((size_t)1 << TRACE_TABLE_BITS)
+#define TRACE_MAX_LIVE (TRACE_TABLE_SIZE / 4 * 3) // live blocks the recorder can follow, it stops beyond that
+#define TRACE_NO_ID (UINT32_MAX)
+
+extern "C" void* __libc_malloc(size_t size);
+extern "C" void* __libc_calloc(size_t num, size_t size);
+extern "C" void* __libc_realloc(void* p, size_t size);
+extern "C" void* __libc_memalign(size_t alignment, size_t size);
+extern "C" void __libc_free(void* p);
+
+// A live block, address 0 marks an empty slot
+typedef struct {
+    uintptr_t address;
+    uint32_t id;
+} trace_slot_t;
+
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static int trace_fd = -1; // -1 while nothing is recorded
+static uint64_t trace_start_ns = 0;
+static trace_event_t trace_buffer[TRACE_BUFFER_EVENTS];
+static size_t trace_buffer_num = 0;
+static trace_slot_t* trace_table = nullptr; // live blocks by address, open addressing with linear probing
+static size_t trace_live_num = 0;
+static uint32_t* trace_free_ids = nullptr; // ids of freed blocks, handed out again before new ones
+static size_t trace_free_ids_num = 0;
+static uint32_t trace_next_id = 0;
+static uint16_t trace_threads_num = 0;
+static thread_local uint16_t trace_thread = 0; // 0 until the first call of the thread
+
+static uint64_t _now_ns()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static bool _write_all(int fd, const void* buf, size_t len)
+{
+    const char* p = (const char*)buf;
+    while (len > 0) {
+        ssize_t written = write(fd, p, len);
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (written <= 0) {
+            return false;
+        }
+        p += written;
+        len -= written;
+    }
+    return true;
+}
+
+static bool _recording()
+{
+    return __atomic_load_n(&trace_fd, __ATOMIC_RELAXED) >= 0;
+}
+
+// the calls below have to be made under trace_lock
+static void _stop(const char* reason)
+{
+    _write_all(trace_fd, trace_buffer, trace_buffer_num * sizeof(trace_event_t));
+    trace_buffer_num = 0;
+    close(trace_fd);
+    __atomic_store_n(&trace_fd, -1, __ATOMIC_RELAXED);
+    if (reason != nullptr) {
+        static const char prefix[] = "malloc_trace: recording stopped, ";
+        _write_all(STDERR_FILENO, prefix, sizeof(prefix) - 1);
+        _write_all(STDERR_FILENO, reason, strlen(reason));
+        _write_all(STDERR_FILENO, "\n", 1);
+    }
+}
+
+static void _record(trace_op_e op, size_t size, uint32_t id, uint32_t arg)
+{
+    if (trace_thread == 0) {
+        trace_thread = ++trace_threads_num;
+    }
+    trace_event_t* event = &trace_buffer[trace_buffer_num++];
+    event->time_ns = _now_ns() - trace_start_ns;
+    event->size = size;
+    event->id = id;
+    event->arg = arg;
+    event->thread = trace_thread;
+    event->op = op;
+    if (trace_buffer_num == TRACE_BUFFER_EVENTS) {
+        if (!_write_all(trace_fd, trace_buffer, sizeof(trace_buffer))) {
+            _stop("the trace could not be written");
+            return;
+        }
+        trace_buffer_num = 0;
+    }
+}
+
+static size_t _slot_index(uintptr_t address)
+{
+    return (size_t)(((address >> 4) * 0x9E3779B97F4A7C15ull) >> (64 - TRACE_TABLE_BITS));
+}
+
+// Gives the block a fresh id, a block the table still holds was freed behind the recorder's back
+// (e.g. allocated before recording started) and is taken as new.
+static uint32_t _insert(void* p)
+{
+    uintptr_t address = (uintptr_t)p;
+    size_t i = _slot_index(address);
+    while (trace_table[i].address != 0 && trace_table[i].address != address) {
+        i = (i + 1) & (TRACE_TABLE_SIZE - 1);
+    }
+    if (trace_table[i].address == address) {
+        trace_free_ids[trace_free_ids_num++] = trace_table[i].id;
+    } else {
+        trace_live_num++;
+    }
+    uint32_t id = (trace_free_ids_num != 0) ? trace_free_ids[--trace_free_ids_num] : trace_next_id++;
+    trace_table[i].address = address;
+    trace_table[i].id = id;
+    return id;
+}
+
+// Returns the id of a live block and forgets it, TRACE_NO_ID if the block was never recorded.
+// The slots after it move back so no lookup has to skip a hole.
+static uint32_t _remove(void* p)
+{
+    uintptr_t address = (uintptr_t)p;
+    size_t i = _slot_index(address);
+    while (trace_table[i].address != address) {
+        if (trace_table[i].address == 0) {
+            return TRACE_NO_ID;
+        }
+        i = (i + 1) & (TRACE_TABLE_SIZE - 1);
+    }
+    uint32_t id = trace_table[i].id;
+    trace_free_ids[trace_free_ids_num++] = id;
+    trace_live_num--;
+    for (size_t j = (i + 1) & (TRACE_TABLE_SIZE - 1); trace_table[j].address != 0; j = (j + 1) & (TRACE_TABLE_SIZE - 1)) {
+        size_t home = _slot_index(trace_table[j].address);
+        // the slot at j stays if its home lies cyclically in (i, j]
+        bool stays = (i < j) ? (i < home && home <= j) : (i < home || home <= j);
+        if (!stays) {
+            trace_table[i] = trace_table[j];
+            i = j;
+        }
+    }
+    trace_table[i].address = 0;
+    return id;
+}
+
+static void _record_alloc(trace_op_e op, void* p, size_t size, uint32_t arg)
+{
+    if (p == nullptr || !_recording()) {
+        return;
+    }
+    pthread_mutex_lock(&trace_lock);
+    if (trace_fd >= 0) {
+        if (trace_live_num >= TRACE_MAX_LIVE) {
+            _stop("too many live blocks");
+        } else {
+            _record(op, size, _insert(p), arg);
+        }
+    }
+    pthread_mutex_unlock(&trace_lock);
+}
+
+static void _record_free(void* p)
+{
+    if (p == nullptr || !_recording()) {
+        return;
+    }
+    pthread_mutex_lock(&trace_lock);
+    if (trace_fd >= 0) {
+        uint32_t id = _remove(p);
+        if (id != TRACE_NO_ID) {
+            _record(TRACE_FREE, 0, id, 0);
+        }
+    }
+    pthread_mutex_unlock(&trace_lock);
+}
+
+// writes the path with every %p replaced by the pid, returns false if that does not fit
+static bool _trace_path(const char* pattern, char* path, size_t path_size, bool* per_process)
+{
+    char pid[24];
+    size_t pid_length = 0;
+    for (long value = getpid(); value != 0 || pid_length == 0; value /= 10) {
+        pid[pid_length++] = '0' + value % 10;
+    }
+    size_t length = 0;
+    *per_process = false;
+    for (const char* c = pattern; *c != '\0'; c++) {
+        if (c[0] == '%' && c[1] == 'p') {
+            *per_process = true;
+            for (size_t i = pid_length; i-- > 0;) {
+                if (length + 1 >= path_size) {
+                    return false;
+                }
+                path[length++] = pid[i];
+            }
+            c++;
+        } else {
+            if (length + 1 >= path_size) {
+                return false;
+            }
+            path[length++] = *c;
+        }
+    }
+    path[length] = '\0';
+    return true;
+}
+
+static void _stop_in_child()
+{
+    trace_fd = -1;
+    trace_buffer_num = 0;
+    pthread_mutex_init(&trace_lock, nullptr);
+}
+
+__attribute__((constructor)) static void _start_trace()
+{
+    const char* pattern = getenv("SMALLOC_TRACE");
+    char path[PATH_MAX];
+    bool per_process;
+    if (pattern == nullptr || !_trace_path(pattern, path, sizeof(path), &per_process)) {
+        return;
+    }
+    if (!per_process) {
+        unsetenv("SMALLOC_TRACE");
+    }
+    trace_table = (trace_slot_t*)mmap(nullptr, TRACE_TABLE_SIZE * sizeof(trace_slot_t), PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    trace_free_ids = (uint32_t*)mmap(nullptr, TRACE_TABLE_SIZE * sizeof(uint32_t), PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (trace_table == MAP_FAILED || trace_free_ids == MAP_FAILED || fd < 0) {
+        static const char message[] = "malloc_trace: cannot start recording\n";
+        _write_all(STDERR_FILENO, message, sizeof(message) - 1);
+        return;
+    }
+    trace_header_t header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, TRACE_MAGIC, sizeof(TRACE_MAGIC));
+    header.event_size = sizeof(trace_event_t);
+    if (!_write_all(fd, &header, sizeof(header))) {
+        close(fd);
+        return;
+    }
+    pthread_atfork(nullptr, nullptr, _stop_in_child);
+    trace_start_ns = _now_ns();
+    __atomic_store_n(&trace_fd, fd, __ATOMIC_RELAXED);
+}
+
+__attribute__((destructor)) static void _finish_trace()
+{
+    pthread_mutex_lock(&trace_lock);
+    if (trace_fd >= 0) {
+        _stop(nullptr);
+    }
+    pthread_mutex_unlock(&trace_lock);
+}
+
+EXPORT void* malloc(size_t size)
+{
+    void* p = __libc_malloc(size);
+    _record_alloc(TRACE_MALLOC, p, size, 0);
+    return p;
+}
+
+EXPORT void free(void* p)
+{
+    _record_free(p);
+    __libc_free(p);
+}
+
+EXPORT void* calloc(size_t num, size_t size)
+{
+    void* p = __libc_calloc(num, size);
+    _record_alloc(TRACE_CALLOC, p, num * size, 0);
+    return p;
+}
+
+EXPORT void* realloc(void* p, size_t size)
+{
+    if (p == nullptr) {
+        return malloc(size);
+    }
+    if (!_recording()) {
+        return __libc_realloc(p, size);
+    }
+    pthread_mutex_lock(&trace_lock);
+    void* newp = __libc_realloc(p, size);
+    // a failed realloc leaves the old block as it was
+    if (trace_fd >= 0 && (newp != nullptr || size == 0)) {
+        uint32_t old_id = _remove(p);
+        if (newp == nullptr) {
+            if (old_id != TRACE_NO_ID) {
+                _record(TRACE_FREE, 0, old_id, 0);
+            }
+        } else if (trace_live_num >= TRACE_MAX_LIVE) {
+            _stop("too many live blocks");
+        } else if (old_id == TRACE_NO_ID) {
+            _record(TRACE_MALLOC, size, _insert(newp), 0);
+        } else {
+            _record(TRACE_REALLOC, size, _insert(newp), old_id);
+        }
+    }
+    pthread_mutex_unlock(&trace_lock);
+    return newp;
+}
+
+EXPORT void* memalign(size_t alignment, size_t size)
+{
+    void* p = __libc_memalign(alignment, size);
+    _record_alloc(TRACE_MEMALIGN, p, size, (uint32_t)alignment);
+    return p;
+}
+
+EXPORT int posix_memalign(void** memptr, size_t alignment, size_t size)
+{
+    if (alignment % sizeof(void*) != 0 || (alignment & (alignment - 1)) != 0) {
+        return EINVAL;
+    }
+    void* p = memalign(alignment, size);
+    if (p == nullptr) {
+        return ENOMEM;
+    }
+    *memptr = p;
+    return 0;
+}
+
+EXPORT void* aligned_alloc(size_t alignment, size_t size)
+{
+    return memalign(alignment, size);
+}
+
+EXPORT void* valloc(size_t size)
+{
+    return memalign(sysconf(_SC_PAGESIZE), size);
+}
+
+EXPORT void* pvalloc(size_t size)
+{
+    size_t page_size = sysconf(_SC_PAGESIZE);
+    return memalign(page_size, (size + page_size - 1) & ~(page_size - 1));
+}